@@ -41,9 +41,18 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 #include <string.h> // CBC mode, for memset
 #include <stdlib.h>
-#include <time.h>
+// x86 AES-NI and SSSE3 for the batched key expansion, when compiled for them
+#if defined(__AES__) && defined(__SSSE3__)
+#define KEY_BATCH_AESNI
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 #include "aes.h"
+// The core lock, see AES_CORE_LOCK
+#if AES_CORE_LOCK
+#include <pthread.h>
+#endif
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -71,23 +80,42 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 typedef uint8_t state_t[4][4];
 static state_t* state;
 
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
 // state mirror 
 
 
 //yayat's guess me if you can algo
 typedef uint8_t state_y[4][4];
 static state_y* state_yat;
+static uint8_t RoundKeyMasked[176] = {0};
+// Set by AES128_ECB_indp_load_masked_schedule(): RoundKeyMasked is already
+// masked with ScheduleMask, moved to fresh masks every block, and RoundKey
+// is not kept.
+static uint8_t ScheduleMasked;
+static uint8_t ScheduleMask[10];
+#endif
 
+#if !LOW_RAM
 // The array that stores the round keys.
 static uint8_t RoundKey[176];
-static uint8_t RoundKeyMasked[176] = {0};
 // The key input to the AES Program
 static uint8_t* Key;
+#else
+// Only the cipher key is kept, round keys are derived during encryption.
+static uint8_t CipherKey[KEYLEN];
+#endif
 uint32_t g_seed;
 
+#if AES_CORE_LOCK
+static pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static uint32_t key_serial;
+
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
 // Protect the mask 
 uint8_t mask_dummy1[10] = {0};
 uint8_t mask_dummy2[10] = {0};
+#endif
 
 
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
@@ -112,6 +140,7 @@ AES_CONST_VAR uint8_t sbox[256] = {
     0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
     0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
 
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
 AES_CONST_VAR uint8_t mul_02[256] = {
     0x00, 0x02, 0x04, 0x06, 0x08, 0x0a, 0x0c, 0x0e, 0x10, 0x12, 0x14, 0x16, 0x18, 0x1a, 0x1c, 0x1e,
     0x20, 0x22, 0x24, 0x26, 0x28, 0x2a, 0x2c, 0x2e, 0x30, 0x32, 0x34, 0x36, 0x38, 0x3a, 0x3c, 0x3e,
@@ -147,38 +176,44 @@ AES_CONST_VAR uint8_t mul_03[256] = {
     0x6b, 0x68, 0x6d, 0x6e, 0x67, 0x64, 0x61, 0x62, 0x73, 0x70, 0x75, 0x76, 0x7f, 0x7c, 0x79, 0x7a,
     0x3b, 0x38, 0x3d, 0x3e, 0x37, 0x34, 0x31, 0x32, 0x23, 0x20, 0x25, 0x26, 0x2f, 0x2c, 0x29, 0x2a,
     0x0b, 0x08, 0x0d, 0x0e, 0x07, 0x04, 0x01, 0x02, 0x13, 0x10, 0x15, 0x16, 0x1f, 0x1c, 0x19, 0x1a};
-	
-AES_CONST_VAR uint8_t sbox_yat[256] =   {
-  //0     1    2      3     4    5     6     7      8    9     A      B    C     D     E     F
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a,
-  0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a, 0xa5, 0x5a };
-	
+#endif
+
 // The round constant word array, Rcon[i], contains the values given by
 // x to the power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
 static const uint8_t Rcon[11] = {
     0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
 
+#if MASKING_ORDER == 1
 static uint8_t SboxMasked[256];
+#endif
 
 static uint8_t getSBoxValue(uint8_t num)
 {
 	return sbox[num];
 }
 
+// Clears key material. memset() is called through a volatile pointer, so the
+// compiler cannot drop it as a dead store the way it does with a plain
+// memset() on a local about to go out of scope.
+static void* (*const volatile wipe_memset)(void*, int, size_t) = memset;
+
+static void wipe(void* p, size_t len)
+{
+  wipe_memset(p, 0, len);
+}
+
+// Stops the compiler from reassociating an XOR chain across x. Without it
+// (a ^ m) ^ m' can be computed as a ^ (m ^ m'), or the other way round,
+// and a chain meant to swap one mask for another passes through the plain
+// value. GCC and Clang get an empty asm statement; elsewhere x goes through
+// a volatile access.
+#if defined(__GNUC__)
+  #define MASK_BARRIER(x) __asm__ volatile ("" : "+r" (x))
+#else
+  #define MASK_BARRIER(x) ((x) = *(volatile uint8_t*)&(x))
+#endif
+
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
 static void calcMixColmask(uint8_t mask[10])
 {
   mask_dummy1[6] = mul_02[mask_dummy1[0]] ^ mul_03[mask_dummy1[1]] ^ mask_dummy1[2]         ^ mask_dummy1[3];
@@ -197,7 +232,9 @@ static void calcMixColmask(uint8_t mask[10])
   mask_dummy1[9] = mul_03[mask_dummy1[0]] ^ mask_dummy1[1]         ^ mask_dummy1[2]         ^ mul_02[mask_dummy1[3]];
   mask[9] = mul_03[mask[0]] ^ mask[1]         ^ mask[2]         ^ mul_02[mask[3]];
 }
+#endif
 
+#if MASKING_ORDER == 1 && !FAULT_DETECTION
 static void remask(state_t * s, uint8_t m1, uint8_t m2, uint8_t m3, uint8_t m4, uint8_t m5, uint8_t m6, uint8_t m7, uint8_t m8)
 {
   for (uint8_t i = 0; i < 4; i++)
@@ -230,7 +267,9 @@ static void SubBytesMasked(void)
     }
   }
 }
+#endif
 
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
 // This function adds the masked round key to state.
 // The round key is added to the state by an XOR function.
 static void AddRoundKeyMasked(uint8_t round) //, const uint8_t* RoundKey)
@@ -243,8 +282,9 @@ static void AddRoundKeyMasked(uint8_t round) //, const uint8_t* RoundKey)
     }
   }
 }
+#endif
 
-
+#if !LOW_RAM
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states.
 static void KeyExpansion(void)
 {
@@ -306,6 +346,37 @@ static void KeyExpansion(void)
     RoundKey[j + 3] = RoundKey[k + 3] ^ tempa[3];
   }
 }
+#endif
+
+#if LOW_RAM
+// Turns the round key of round - 1 into the one of round, in place. The key
+// stays masked with km: SubWord goes through the masked S-box, indexed with
+// km_in (the masks of the last word changed to M once per block), and its
+// output mask M' is taken off after the XOR into the key; the running XOR
+// over the words is corrected by the mask of the word added in. Each XOR of
+// two masked values is fenced with MASK_BARRIER(), so no step leaves a key
+// byte unmasked.
+static void NextRoundKey(uint8_t rk[16], const uint8_t km[16], const uint8_t km_in[4], const uint8_t mask[10], uint8_t round)
+{
+  uint8_t i, t;
+
+  // SubWord(RotWord(w[i - 1])) ^ Rcon into the first word
+  for (i = 0; i < 4; i++)
+  {
+    t = rk[i] ^ SboxMasked[rk[12 + ((i + 1) & 3)] ^ km_in[(i + 1) & 3]];
+    MASK_BARRIER(t);
+    rk[i] = t ^ mask[5];
+  }
+  rk[0] ^= Rcon[round];
+
+  for (i = 4; i < 16; i++)
+  {
+    t = rk[i] ^ rk[i - 4];
+    MASK_BARRIER(t);
+    rk[i] = t ^ km[i - 4];
+  }
+}
+#endif
 
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
@@ -339,6 +410,7 @@ static void SubBytes(void)
 }
 #endif
 
+#if !FAULT_DETECTION
 // The ShiftRows() function shifts the rows in the state to the left.
 // Each row is shifted with different offset.
 // Offset = Row number. So the first row is not shifted.
@@ -370,11 +442,23 @@ static void ShiftRows(void)
   (*state)[1][3] = temp;
 }
 
+#endif
+
 static uint8_t xtime(uint8_t x)
 {
   return ((x << 1) ^ (((x >> 7) & 1) * 0x1b));
 }
 
+// MixColumns applied to the row masks M1..M4, giving M1'..M4'.
+static void MixColumnsMask(uint8_t mask[10])
+{
+  mask[6] = xtime(mask[0] ^ mask[1]) ^ mask[1] ^ mask[2] ^ mask[3];
+  mask[7] = mask[0] ^ xtime(mask[1] ^ mask[2]) ^ mask[2] ^ mask[3];
+  mask[8] = mask[0] ^ mask[1] ^ xtime(mask[2] ^ mask[3]) ^ mask[3];
+  mask[9] = xtime(mask[0] ^ mask[3]) ^ mask[0] ^ mask[1] ^ mask[2];
+}
+
+#if !FAULT_DETECTION
 // MixColumns function mixes the columns of the state matrix
 static void MixColumns(void)
 {
@@ -392,6 +476,8 @@ static void MixColumns(void)
         (*state)[i][3] = xtime(temp[0] ^ temp[3]) ^ temp[0] ^ temp[1] ^ temp[2];
     }
 }
+#endif
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
 // MixColumns ghost
 static void MixColumnsGhost(void)
 {
@@ -409,128 +495,39 @@ static void MixColumnsGhost(void)
         (*state_yat)[i][3] = xtime(temp[0] ^ temp[3]) ^ temp[0] ^ temp[1] ^ temp[2];
     }
 }
+#endif
 
 static uint8_t generateRandom(void) {
     g_seed = (214013 * g_seed + 2531011);
     return (g_seed >> 16) & 0x7FFF;
 }
 
-void delay(int number_of_seconds)
-{
-    // Converting time into milli_seconds
-    int milli_seconds = 1000 * number_of_seconds;
-    // Storing start time
-    clock_t start_time = clock();
-    // looping till required time is not achieved
-    while (clock() < start_time + milli_seconds);
-}
- 
-static void Gen_delay(uint8_t level)
-{
-    for(int i = 0; i < level; i++)
-	{
-		delay(10);
-	}
-}
-	
-static void InitMaskingEncrypt(uint8_t mask[10])
-{
-	uint8_t int_rand1 = (uint8_t)((*state)[0][0] ^ (*state)[0][1] ^ (*state)[0][2] ^ (*state)[0][3]);
-    uint8_t int_rand2 = (uint8_t)((*state)[1][0] ^ (*state)[1][1] ^ (*state)[1][2] ^ (*state)[1][3]);
-    uint8_t int_rand3 = (uint8_t)((*state)[2][0] ^ (*state)[2][1] ^ (*state)[2][2] ^ (*state)[2][3]);
-    uint8_t int_rand4 = (uint8_t)((*state)[3][0] ^ (*state)[3][1] ^ (*state)[3][2] ^ (*state)[3][3]);
-
-    g_seed = (int_rand1 << 24) | (int_rand2 << 16) | (int_rand3 << 8) | (int_rand4);
-	
-	mask[4] = generateRandom();
-	memcpy(RoundKeyMasked, RoundKey, 176);
-	
-	
-	//Delay
-	// Gen_delay(5);
-	
-	// V3
-	for (uint8_t i = 2; i < 4; i++) {
-        mask[i] = generateRandom();
-    }
-	
-	for (uint8_t i = 0; i < 3; i++) 
-	{
-		mask_dummy1[i] = generateRandom();
-	}
-	mask[0] = generateRandom();
-	for (uint8_t i = 0; i < 2; i++)
-	{
-		mask_dummy2[i] = generateRandom();
-	}
-	mask[1] = generateRandom();
-	for (uint8_t i = 2; i < 4; i++)
-	{
-		mask_dummy2[i] = generateRandom();
-	}
-	for (uint8_t i = 3; i < 6; i++)
-	{
-		mask_dummy1[i] = generateRandom();
-	}
-	mask_dummy2[4] = generateRandom();
-	// mask[5] = generateRandom();
-	mask_dummy2[5] = generateRandom();
-	
-	//Calculate m1',m2',m3',m4'
-	calcMixColmask(mask);
-	mask[5] = generateRandom();
-	//Delay 
-	// Gen_delay(5);
-	
-	//Calculate the masked Sbox
-	calcSboxMasked(mask); //m' -> m
-
-	//Init masked key
-	//	Last round mask M' to mask 0
-	remask(state_yat, mask_dummy1[0], mask_dummy1[1], mask_dummy1[2], mask_dummy1[3], mask_dummy2[5], mask_dummy1[5], mask_dummy2[5], mask_dummy2[5]);
-	remask((state_t *) &RoundKeyMasked[(Nr * Nb * 4)], 0, 0, 0, 0, mask[5], mask[5], mask[5], mask[5]);
-
-	// Mask change from M1',M2',M3',M4' to M
-	for (uint8_t i = 0; i < Nr; i++)
-	{
-		remask((state_t *) &RoundKeyMasked[(i * Nb * 4)], mask[6], mask[7], mask[8], mask[9], mask[4], mask[4], mask[4], mask[4]);
-		remask(state_yat, mask_dummy1[6], mask_dummy1[7], mask_dummy1[8], mask_dummy1[9], mask[0], mask[0], mask[0], mask[0]);
-	}
-}
+#if RANDOM_DELAY_MAX > 0
+static volatile uint8_t delay_sink;
+#endif
 
-// Cipher is the main function that encrypts the PlainText.
-static void CipherMasked(void)
+// Random delay: burns between 0 and RANDOM_DELAY_MAX dummy iterations, the
+// count being drawn from the mask PRNG. Each iteration is one dependent
+// xtime/XOR step, see aes.h for its cost.
+static void RandomDelay(void)
 {
-  // uint8_t RoundKeyMasked[AES_keyExpSize] = {0};
-  uint8_t mask[10] = {0};
-  uint8_t round = 0;
-
-  InitMaskingEncrypt(mask);
-
-  //Plain text masked with m1',m2',m3',m4'
-  remask(state, mask[6], mask[7], mask[8], mask[9], 0, 0, 0, 0);
-
-  // Masks change from M1',M2',M3',M4' to M
-  //AddRoundKeyMasked(0);
+#if RANDOM_DELAY_MAX > 0
+  uint16_t n = (uint16_t)(((generateRandom() << 8) | generateRandom()) % (RANDOM_DELAY_MAX + 1));
+  uint8_t acc = (uint8_t)n;
+  while (n--)
   {
-	  
-	  uint8_t i, j;
-	  for(i = 0; i < 4; i++){
-		for (j = 0; j < 4; ++j)
-		{
-		  (*state_yat)[j][i] ^= (RoundKeyMasked[(round * Nb * 4) + (i * Nb) + j] ^ 0xa5);
-		  (*state)[i][j] ^= RoundKeyMasked[(round * Nb * 4) + (i * Nb) + j];
-		}
-	  }
+    acc = xtime(acc) ^ (uint8_t)n;
   }
-  
-  // There will be Nr rounds.
-  // The first Nr-1 rounds are identical.
-  // These Nr rounds are executed in the loop below.
-  // Last one without MixColumns()
-  for (round = 1;; round++)
-  {
-    // Mask changes from M to M'
+  delay_sink = acc;
+#endif
+}
+
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+// One round of CipherMasked(), decoys on the ghost state included. The last
+// round stops after ShiftRows.
+static void RoundMasked(uint8_t round, const uint8_t mask[10])
+{
+  // Mask changes from M to M'
 	if (round == 1 || round == 8 || round == 9 || round == 10)
 	{
 		uint8_t i, j;
@@ -581,7 +578,7 @@ static void CipherMasked(void)
 	{
 		SubBytesMasked();	
 	}
-    //No impact on mask
+  //No impact on mask
 	if (round  != 1 || round != 8 || round != 9 || round != 10)
 	{
 		uint8_t temp;
@@ -636,23 +633,23 @@ static void CipherMasked(void)
 	{
 		ShiftRows();
 	}
-    
-    if (round == Nr)
-    {
-      break;
-    }
-    //Change mask from M' to
-    // M1 for first row
-    // M2 for second row
-    // M3 for third row
-    // M4 for fourth row
-    remask(state, mask[0], mask[1], mask[2], mask[3], mask[5], mask[5], mask[5], mask[5]);
+  
+  if (round == Nr)
+  {
+    return;
+  }
+  //Change mask from M' to
+  // M1 for first row
+  // M2 for second row
+  // M3 for third row
+  // M4 for fourth row
+  remask(state, mask[0], mask[1], mask[2], mask[3], mask[5], mask[5], mask[5], mask[5]);
 
-    // Masks change from M1,M2,M3,M4 to M1',M2',M3',M4'
-    MixColumns();
+  // Masks change from M1,M2,M3,M4 to M1',M2',M3',M4'
+  MixColumns();
 
-    // Add the First round key to the state before starting the rounds.
-    // Masks change from M1',M2',M3',M4' to M
+  // Add the First round key to the state before starting the rounds.
+  // Masks change from M1',M2',M3',M4' to M
 	if (round == 2 || round == 3 || round == 5 || round == 7)
 	{
 		{
@@ -671,70 +668,1052 @@ static void CipherMasked(void)
 	{
 		AddRoundKeyMasked(round);
 	}
-    
-  }
-
-  // Mask are removed by the last addroundkey
-  // From M' to 0
-  remask(state_yat, mask_dummy1[0], mask_dummy2[1], mask_dummy1[2], mask_dummy2[3], mask[4], mask[4], mask[4], mask[4]);
-  MixColumnsGhost();
-  AddRoundKeyMasked(Nr);
 }
+#endif
 
-// Cipher is the main function that encrypts the PlainText.
-#ifndef SECURE
-static void Cipher(void)
-{
-  uint8_t round = 0;
-
-  // Add the First round key to the state before starting the rounds.
-  AddRoundKey(0);
+#if DUMMY_ROUNDS > 0
+static uint8_t DummyState[16];
+static uint8_t DummyGhost[16];
 
-  // There will be Nr rounds.
-  // The first Nr-1 rounds are identical.
-  // These Nr rounds are executed in the loop below.
-  // Last one without MixColumns()
-  for (round = 1;; ++round)
+// Draws the rounds in front of which the dummy rounds are played.
+static void PlaceDummyRounds(uint8_t dummy_at[Nr + 1])
+{
+  uint8_t i;
+  memset(dummy_at, 0, Nr + 1);
+  for (i = 0; i < DUMMY_ROUNDS; i++)
   {
-    SubBytes();
-    ShiftRows();
-    if (round == Nr)
-    {
-      break;
-    }
-    MixColumns();
-    AddRoundKey(round);
+    dummy_at[1 + (generateRandom() % Nr)]++;
+  }
+  for (i = 0; i < 16; i++)
+  {
+    DummyState[i] = generateRandom();
+    DummyGhost[i] = generateRandom();
   }
-  // Add round key to last round
-  AddRoundKey(Nr);
 }
-#endif
 
+// A dummy round is RoundMasked() itself, with the masks of the encryption and
+// the masked key of a random middle round, on random state and ghost data.
+static void DummyRound(const uint8_t mask[10])
+{
+  state_t* real = state;
+  state_y* real_yat = state_yat;
+  state = (state_t*)DummyState;
+  state_yat = (state_y*)DummyGhost;
+  RoundMasked(1 + (generateRandom() % (Nr - 1)), mask);
+  state = real;
+  state_yat = real_yat;
+}
+#endif
 
-void AES128_ECB_indp_setkey(uint8_t* key)
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+// Moves RoundKeyMasked, installed masked, from the masks in ScheduleMask to
+// mask and keeps mask as the new ScheduleMask. Only the differences between
+// the two mask sets are XORed into the key bytes, so the plain schedule is
+// never formed and no two blocks share their masks.
+static void RemaskSchedule(const uint8_t mask[10])
 {
-  Key = key;
-  KeyExpansion();
+  uint8_t d[5];
+  uint8_t i;
+
+  for (i = 0; i < 4; i++)
+  {
+    d[i] = ScheduleMask[6 + i] ^ ScheduleMask[4];
+    MASK_BARRIER(d[i]);
+    d[i] ^= mask[6 + i] ^ mask[4];
+    MASK_BARRIER(d[i]);
+  }
+  d[4] = ScheduleMask[5] ^ mask[5];
+  MASK_BARRIER(d[4]);
+  for (i = 0; i < Nr; i++)
+  {
+    remask((state_t *) &RoundKeyMasked[(i * Nb * 4)], d[0], d[1], d[2], d[3], 0, 0, 0, 0);
+  }
+  remask((state_t *) &RoundKeyMasked[(Nr * Nb * 4)], d[4], d[4], d[4], d[4], 0, 0, 0, 0);
+  memcpy(ScheduleMask, mask, 10);
+  wipe(d, sizeof(d));
 }
 
-void AES128_ECB_indp_crypto(uint8_t* input)
+static void InitMaskingEncrypt(uint8_t mask[10])
 {
-	state = (state_t*)input;
+	uint8_t int_rand1 = (uint8_t)((*state)[0][0] ^ (*state)[0][1] ^ (*state)[0][2] ^ (*state)[0][3]);
+    uint8_t int_rand2 = (uint8_t)((*state)[1][0] ^ (*state)[1][1] ^ (*state)[1][2] ^ (*state)[1][3]);
+    uint8_t int_rand3 = (uint8_t)((*state)[2][0] ^ (*state)[2][1] ^ (*state)[2][2] ^ (*state)[2][3]);
+    uint8_t int_rand4 = (uint8_t)((*state)[3][0] ^ (*state)[3][1] ^ (*state)[3][2] ^ (*state)[3][3]);
+
+    g_seed = (int_rand1 << 24) | (int_rand2 << 16) | (int_rand3 << 8) | (int_rand4);
 	
-	state_yat = (state_y*)malloc(sizeof(state_y));
-	// Check if memory allocation was successful
-	if (state == NULL || state_yat == NULL)
+	mask[4] = generateRandom();
+	if (!ScheduleMasked)
 	{
-		return;
+		memcpy(RoundKeyMasked, RoundKey, 176);
 	}
 	
-	memcpy(state_yat, input, sizeof(state_y));
 	
-#ifdef SECURE 
-	CipherMasked();
-#else 
-	Cipher();
-#endif
+	//Delay
+	RandomDelay();
 	
-	free(state_yat);
+	// V3
+	for (uint8_t i = 2; i < 4; i++) {
+        mask[i] = generateRandom();
+    }
+	
+	for (uint8_t i = 0; i < 3; i++) 
+	{
+		mask_dummy1[i] = generateRandom();
+	}
+	mask[0] = generateRandom();
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		mask_dummy2[i] = generateRandom();
+	}
+	mask[1] = generateRandom();
+	for (uint8_t i = 2; i < 4; i++)
+	{
+		mask_dummy2[i] = generateRandom();
+	}
+	for (uint8_t i = 3; i < 6; i++)
+	{
+		mask_dummy1[i] = generateRandom();
+	}
+	mask_dummy2[4] = generateRandom();
+	// mask[5] = generateRandom();
+	mask_dummy2[5] = generateRandom();
+	
+	//Calculate m1',m2',m3',m4'
+	calcMixColmask(mask);
+	mask[5] = generateRandom();
+	//Delay
+	RandomDelay();
+	
+	//Calculate the masked Sbox
+	calcSboxMasked(mask); //m' -> m
+
+	//Init masked key
+	//	Last round mask M' to mask 0
+	remask(state_yat, mask_dummy1[0], mask_dummy1[1], mask_dummy1[2], mask_dummy1[3], mask_dummy2[5], mask_dummy1[5], mask_dummy2[5], mask_dummy2[5]);
+	if (!ScheduleMasked)
+	{
+		remask((state_t *) &RoundKeyMasked[(Nr * Nb * 4)], 0, 0, 0, 0, mask[5], mask[5], mask[5], mask[5]);
+	}
+	else
+	{
+		// A schedule installed masked moves on to this block's masks
+		RemaskSchedule(mask);
+	}
+
+	// Mask change from M1',M2',M3',M4' to M
+	for (uint8_t i = 0; i < Nr; i++)
+	{
+		if (!ScheduleMasked)
+		{
+			remask((state_t *) &RoundKeyMasked[(i * Nb * 4)], mask[6], mask[7], mask[8], mask[9], mask[4], mask[4], mask[4], mask[4]);
+		}
+		remask(state_yat, mask_dummy1[6], mask_dummy1[7], mask_dummy1[8], mask_dummy1[9], mask[0], mask[0], mask[0], mask[0]);
+	}
+}
+
+// Cipher is the main function that encrypts the PlainText.
+static void CipherMasked(void)
+{
+  // uint8_t RoundKeyMasked[AES_keyExpSize] = {0};
+  uint8_t mask[10] = {0};
+  uint8_t round = 0;
+#if DUMMY_ROUNDS > 0
+  uint8_t dummy_at[Nr + 1];
+#endif
+
+  InitMaskingEncrypt(mask);
+#if DUMMY_ROUNDS > 0
+  PlaceDummyRounds(dummy_at);
+#endif
+
+  //Plain text masked with m1',m2',m3',m4'
+  remask(state, mask[6], mask[7], mask[8], mask[9], 0, 0, 0, 0);
+
+  // Masks change from M1',M2',M3',M4' to M
+  //AddRoundKeyMasked(0);
+  {
+	  
+	  uint8_t i, j;
+	  for(i = 0; i < 4; i++){
+		for (j = 0; j < 4; ++j)
+		{
+		  (*state_yat)[j][i] ^= (RoundKeyMasked[(round * Nb * 4) + (i * Nb) + j] ^ 0xa5);
+		  (*state)[i][j] ^= RoundKeyMasked[(round * Nb * 4) + (i * Nb) + j];
+		}
+	  }
+  }
+  
+  // There will be Nr rounds.
+  // The first Nr-1 rounds are identical.
+  // These Nr rounds are executed in the loop below.
+  // Last one without MixColumns()
+  for (round = 1; round <= Nr; round++)
+  {
+    RandomDelay();
+#if DUMMY_ROUNDS > 0
+    for (; dummy_at[round] > 0; dummy_at[round]--)
+    {
+      DummyRound(mask);
+    }
+#endif
+    RoundMasked(round, mask);
+  }
+
+  // Mask are removed by the last addroundkey
+  // From M' to 0
+  remask(state_yat, mask_dummy1[0], mask_dummy2[1], mask_dummy1[2], mask_dummy2[3], mask[4], mask[4], mask[4], mask[4]);
+  MixColumnsGhost();
+  AddRoundKeyMasked(Nr);
+}
+#endif // if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+
+#if MASKING_ORDER > 1
+/*****************************************************************************/
+/* Higher-order masking:                                                     */
+/*****************************************************************************/
+// Every state byte is split into MASK_SHARES Boolean shares,
+//   x = s[0] ^ s[1] ^ ... ^ s[MASK_SHARES - 1]
+// ShiftRows and MixColumns are linear and run on each share on its own.
+// The S-box is computed as x^254 with the ISW multiplication gadget
+// (Rivain-Prouff), followed by the affine map applied share-wise.
+#define MASK_SHARES (MASKING_ORDER + 1)
+
+static uint8_t StateShares[MASK_SHARES][16];
+
+// gf_exp[i] = 0x03^i, with gf_exp[255] = gf_exp[0] so that sums of two logs
+// can be reduced with a single fold.
+AES_CONST_VAR uint8_t gf_exp[256] = {
+    0x01, 0x03, 0x05, 0x0f, 0x11, 0x33, 0x55, 0xff, 0x1a, 0x2e, 0x72, 0x96, 0xa1, 0xf8, 0x13, 0x35,
+    0x5f, 0xe1, 0x38, 0x48, 0xd8, 0x73, 0x95, 0xa4, 0xf7, 0x02, 0x06, 0x0a, 0x1e, 0x22, 0x66, 0xaa,
+    0xe5, 0x34, 0x5c, 0xe4, 0x37, 0x59, 0xeb, 0x26, 0x6a, 0xbe, 0xd9, 0x70, 0x90, 0xab, 0xe6, 0x31,
+    0x53, 0xf5, 0x04, 0x0c, 0x14, 0x3c, 0x44, 0xcc, 0x4f, 0xd1, 0x68, 0xb8, 0xd3, 0x6e, 0xb2, 0xcd,
+    0x4c, 0xd4, 0x67, 0xa9, 0xe0, 0x3b, 0x4d, 0xd7, 0x62, 0xa6, 0xf1, 0x08, 0x18, 0x28, 0x78, 0x88,
+    0x83, 0x9e, 0xb9, 0xd0, 0x6b, 0xbd, 0xdc, 0x7f, 0x81, 0x98, 0xb3, 0xce, 0x49, 0xdb, 0x76, 0x9a,
+    0xb5, 0xc4, 0x57, 0xf9, 0x10, 0x30, 0x50, 0xf0, 0x0b, 0x1d, 0x27, 0x69, 0xbb, 0xd6, 0x61, 0xa3,
+    0xfe, 0x19, 0x2b, 0x7d, 0x87, 0x92, 0xad, 0xec, 0x2f, 0x71, 0x93, 0xae, 0xe9, 0x20, 0x60, 0xa0,
+    0xfb, 0x16, 0x3a, 0x4e, 0xd2, 0x6d, 0xb7, 0xc2, 0x5d, 0xe7, 0x32, 0x56, 0xfa, 0x15, 0x3f, 0x41,
+    0xc3, 0x5e, 0xe2, 0x3d, 0x47, 0xc9, 0x40, 0xc0, 0x5b, 0xed, 0x2c, 0x74, 0x9c, 0xbf, 0xda, 0x75,
+    0x9f, 0xba, 0xd5, 0x64, 0xac, 0xef, 0x2a, 0x7e, 0x82, 0x9d, 0xbc, 0xdf, 0x7a, 0x8e, 0x89, 0x80,
+    0x9b, 0xb6, 0xc1, 0x58, 0xe8, 0x23, 0x65, 0xaf, 0xea, 0x25, 0x6f, 0xb1, 0xc8, 0x43, 0xc5, 0x54,
+    0xfc, 0x1f, 0x21, 0x63, 0xa5, 0xf4, 0x07, 0x09, 0x1b, 0x2d, 0x77, 0x99, 0xb0, 0xcb, 0x46, 0xca,
+    0x45, 0xcf, 0x4a, 0xde, 0x79, 0x8b, 0x86, 0x91, 0xa8, 0xe3, 0x3e, 0x42, 0xc6, 0x51, 0xf3, 0x0e,
+    0x12, 0x36, 0x5a, 0xee, 0x29, 0x7b, 0x8d, 0x8c, 0x8f, 0x8a, 0x85, 0x94, 0xa7, 0xf2, 0x0d, 0x17,
+    0x39, 0x4b, 0xdd, 0x7c, 0x84, 0x97, 0xa2, 0xfd, 0x1c, 0x24, 0x6c, 0xb4, 0xc7, 0x52, 0xf6, 0x01};
+
+// gf_log[gf_exp[i]] = i. gf_log[0] is unused.
+AES_CONST_VAR uint8_t gf_log[256] = {
+    0x00, 0x00, 0x19, 0x01, 0x32, 0x02, 0x1a, 0xc6, 0x4b, 0xc7, 0x1b, 0x68, 0x33, 0xee, 0xdf, 0x03,
+    0x64, 0x04, 0xe0, 0x0e, 0x34, 0x8d, 0x81, 0xef, 0x4c, 0x71, 0x08, 0xc8, 0xf8, 0x69, 0x1c, 0xc1,
+    0x7d, 0xc2, 0x1d, 0xb5, 0xf9, 0xb9, 0x27, 0x6a, 0x4d, 0xe4, 0xa6, 0x72, 0x9a, 0xc9, 0x09, 0x78,
+    0x65, 0x2f, 0x8a, 0x05, 0x21, 0x0f, 0xe1, 0x24, 0x12, 0xf0, 0x82, 0x45, 0x35, 0x93, 0xda, 0x8e,
+    0x96, 0x8f, 0xdb, 0xbd, 0x36, 0xd0, 0xce, 0x94, 0x13, 0x5c, 0xd2, 0xf1, 0x40, 0x46, 0x83, 0x38,
+    0x66, 0xdd, 0xfd, 0x30, 0xbf, 0x06, 0x8b, 0x62, 0xb3, 0x25, 0xe2, 0x98, 0x22, 0x88, 0x91, 0x10,
+    0x7e, 0x6e, 0x48, 0xc3, 0xa3, 0xb6, 0x1e, 0x42, 0x3a, 0x6b, 0x28, 0x54, 0xfa, 0x85, 0x3d, 0xba,
+    0x2b, 0x79, 0x0a, 0x15, 0x9b, 0x9f, 0x5e, 0xca, 0x4e, 0xd4, 0xac, 0xe5, 0xf3, 0x73, 0xa7, 0x57,
+    0xaf, 0x58, 0xa8, 0x50, 0xf4, 0xea, 0xd6, 0x74, 0x4f, 0xae, 0xe9, 0xd5, 0xe7, 0xe6, 0xad, 0xe8,
+    0x2c, 0xd7, 0x75, 0x7a, 0xeb, 0x16, 0x0b, 0xf5, 0x59, 0xcb, 0x5f, 0xb0, 0x9c, 0xa9, 0x51, 0xa0,
+    0x7f, 0x0c, 0xf6, 0x6f, 0x17, 0xc4, 0x49, 0xec, 0xd8, 0x43, 0x1f, 0x2d, 0xa4, 0x76, 0x7b, 0xb7,
+    0xcc, 0xbb, 0x3e, 0x5a, 0xfb, 0x60, 0xb1, 0x86, 0x3b, 0x52, 0xa1, 0x6c, 0xaa, 0x55, 0x29, 0x9d,
+    0x97, 0xb2, 0x87, 0x90, 0x61, 0xbe, 0xdc, 0xfc, 0xbc, 0x95, 0xcf, 0xcd, 0x37, 0x3f, 0x5b, 0xd1,
+    0x53, 0x39, 0x84, 0x3c, 0x41, 0xa2, 0x6d, 0x47, 0x14, 0x2a, 0x9e, 0x5d, 0x56, 0xf2, 0xd3, 0xab,
+    0x44, 0x11, 0x92, 0xd9, 0x23, 0x20, 0x2e, 0x89, 0xb4, 0x7c, 0xb8, 0x26, 0x77, 0x99, 0xe3, 0xa5,
+    0x67, 0x4a, 0xed, 0xde, 0xc5, 0x31, 0xfe, 0x18, 0x0d, 0x63, 0x8c, 0x80, 0xc0, 0xf7, 0x70, 0x07};
+
+// Multiplication in GF(2^8) through the log/exp tables. The zero case is
+// handled with a mask instead of a branch.
+static uint8_t gmul(uint8_t a, uint8_t b)
+{
+  uint16_t s = (uint16_t)gf_log[a] + gf_log[b];
+  uint8_t nz = (uint8_t)(-((a != 0) & (b != 0)));
+  s = (s & 0xff) + (s >> 8);
+  return gf_exp[s] & nz;
+}
+
+// Re-randomizes the sharing of a without changing the value it encodes.
+// ISW refresh, one random per pair of shares: the linear refresh with one
+// random per share does not make the x * x^2 products of the x^254 chain
+// secure at orders 2 and 3 (Coron-Prouff-Rivain-Roche, FSE 2013).
+static void RefreshMasks(uint8_t a[MASK_SHARES])
+{
+  uint8_t i, j, r;
+  for (i = 0; i < MASK_SHARES; i++)
+  {
+    for (j = i + 1; j < MASK_SHARES; j++)
+    {
+      r = generateRandom();
+      a[i] ^= r;
+      a[j] ^= r;
+    }
+  }
+}
+
+// ISW gadget: c = a * b, secure at order MASKING_ORDER.
+static void SecMult(uint8_t c[MASK_SHARES], const uint8_t a[MASK_SHARES], const uint8_t b[MASK_SHARES])
+{
+  uint8_t i, j, r;
+  for (i = 0; i < MASK_SHARES; i++)
+  {
+    c[i] = gmul(a[i], b[i]);
+  }
+  for (i = 0; i < MASK_SHARES; i++)
+  {
+    for (j = i + 1; j < MASK_SHARES; j++)
+    {
+      r = generateRandom();
+      c[i] ^= r;
+      c[j] ^= (r ^ gmul(a[i], b[j])) ^ gmul(a[j], b[i]);
+    }
+  }
+}
+
+// Raises every share to the power 2^n. Squaring is linear in GF(2^8).
+static void SquareShares(uint8_t a[MASK_SHARES], uint8_t n)
+{
+  uint8_t i;
+  for (; n > 0; n--)
+  {
+    for (i = 0; i < MASK_SHARES; i++)
+    {
+      a[i] = gmul(a[i], a[i]);
+    }
+  }
+}
+
+// S(x) = A(x^254) ^ 0x63
+static void SBoxShares(uint8_t x[MASK_SHARES])
+{
+  uint8_t z[MASK_SHARES], w[MASK_SHARES], y[MASK_SHARES], t[MASK_SHARES];
+  uint8_t i, v;
+
+  memcpy(z, x, MASK_SHARES);
+  SquareShares(z, 1);           // x^2
+  RefreshMasks(z);
+  SecMult(y, z, x);             // x^3
+  memcpy(w, y, MASK_SHARES);
+  SquareShares(w, 2);           // x^12
+  RefreshMasks(w);
+  SecMult(t, y, w);             // x^15
+  SquareShares(t, 4);           // x^240
+  SecMult(y, t, w);             // x^252
+  SecMult(t, y, z);             // x^254
+
+  for (i = 0; i < MASK_SHARES; i++)
+  {
+    v = t[i];
+    x[i] = v ^ (uint8_t)((v << 1) | (v >> 7)) ^ (uint8_t)((v << 2) | (v >> 6))
+             ^ (uint8_t)((v << 3) | (v >> 5)) ^ (uint8_t)((v << 4) | (v >> 4));
+  }
+  x[0] ^= 0x63;
+}
+
+static void SubBytesShares(void)
+{
+  uint8_t x[MASK_SHARES];
+  uint8_t i, s;
+  for (i = 0; i < 16; i++)
+  {
+    for (s = 0; s < MASK_SHARES; s++)
+    {
+      x[s] = StateShares[s][i];
+    }
+    SBoxShares(x);
+    for (s = 0; s < MASK_SHARES; s++)
+    {
+      StateShares[s][i] = x[s];
+    }
+  }
+}
+
+// The round key only has to enter one share.
+static void AddRoundKeyShares(uint8_t round)
+{
+  uint8_t i;
+  for (i = 0; i < 16; i++)
+  {
+    StateShares[0][i] ^= RoundKey[(round * Nb * 4) + i];
+  }
+}
+
+// Applies ShiftRows() (and MixColumns()) to every share in turn.
+static void LinearLayerShares(uint8_t mix)
+{
+  uint8_t s;
+  for (s = 0; s < MASK_SHARES; s++)
+  {
+    state = (state_t*)StateShares[s];
+    ShiftRows();
+    if (mix)
+    {
+      MixColumns();
+    }
+  }
+}
+
+// Cipher is the main function that encrypts the PlainText.
+static void CipherMaskedShares(void)
+{
+  uint8_t* output = (uint8_t*)state;
+  uint8_t round, i, s;
+
+  // Same seeding as InitMaskingEncrypt()
+  g_seed = 0;
+  for (i = 0; i < 4; i++)
+  {
+    g_seed = (g_seed << 8) | (uint8_t)((*state)[i][0] ^ (*state)[i][1] ^ (*state)[i][2] ^ (*state)[i][3]);
+  }
+
+  // Split the plain text into shares
+  for (i = 0; i < 16; i++)
+  {
+    StateShares[0][i] = output[i];
+    for (s = 1; s < MASK_SHARES; s++)
+    {
+      StateShares[s][i] = generateRandom();
+      StateShares[0][i] ^= StateShares[s][i];
+    }
+  }
+
+  AddRoundKeyShares(0);
+  for (round = 1; round < Nr; round++)
+  {
+    RandomDelay();
+    SubBytesShares();
+    LinearLayerShares(1);
+    AddRoundKeyShares(round);
+  }
+  RandomDelay();
+  SubBytesShares();
+  LinearLayerShares(0);
+  AddRoundKeyShares(Nr);
+
+  // Recombine
+  for (i = 0; i < 16; i++)
+  {
+    output[i] = StateShares[0][i];
+    for (s = 1; s < MASK_SHARES; s++)
+    {
+      output[i] ^= StateShares[s][i];
+    }
+  }
+  state = (state_t*)output;
+  memset(StateShares, 0, sizeof(StateShares));
+}
+#endif // #if MASKING_ORDER > 1
+
+#if FAULT_DETECTION
+/*****************************************************************************/
+/* Fault detection:                                                          */
+/*****************************************************************************/
+// Two encryptions of the same block run side by side, each under its own
+// masks. A state column is one 64-bit word: lane A in bits 0..31, lane B in
+// bits 32..63, row r of a lane in byte r. ShiftRows, MixColumns and the key
+// and mask additions then process both lanes with the same instructions,
+// and the S-box lookups of the two lanes are independent of each other.
+// The unmasked results must agree before anything is released.
+#define LANE_LO 0x00000000ffffffffULL
+#define LANE_HI 0xffffffff00000000ULL
+
+static uint64_t StateDual[4];
+static uint8_t SboxMaskedB[256];
+static uint32_t fault_count;
+
+// Per-encryption mask words, both lanes packed like a state column.
+static uint64_t MaskIn;      // M1',M2',M3',M4' per row
+static uint64_t MaskKey;     // M1',M2',M3',M4' to M
+static uint64_t MaskMix;     // M' to M1,M2,M3,M4
+static uint64_t MaskLast;    // M' to 0
+
+// Rotates each lane one row up: row r receives row r + 1.
+static uint64_t RotRowsDual(uint64_t w)
+{
+  return ((w >> 8) & 0x00ffffff00ffffffULL) | ((w << 24) & 0xff000000ff000000ULL);
+}
+
+static uint64_t xtimeDual(uint64_t w)
+{
+  return ((w & 0x7f7f7f7f7f7f7f7fULL) << 1) ^ (((w >> 7) & 0x0101010101010101ULL) * 0x1b);
+}
+
+static uint64_t MixColumnDual(uint64_t w)
+{
+  uint64_t r1 = RotRowsDual(w);
+  uint64_t r2 = RotRowsDual(r1);
+  uint64_t r3 = RotRowsDual(r2);
+  return xtimeDual(w ^ r1) ^ r1 ^ r2 ^ r3;
+}
+
+static void MixColumnsDual(void)
+{
+  uint8_t i;
+  for (i = 0; i < 4; i++)
+  {
+    StateDual[i] = MixColumnDual(StateDual[i]);
+  }
+}
+
+static void ShiftRowsDual(void)
+{
+  const uint64_t r0 = 0x000000ff000000ffULL;
+  const uint64_t r1 = r0 << 8, r2 = r0 << 16, r3 = r0 << 24;
+  uint64_t s0 = StateDual[0], s1 = StateDual[1], s2 = StateDual[2], s3 = StateDual[3];
+
+  StateDual[0] = (s0 & r0) | (s1 & r1) | (s2 & r2) | (s3 & r3);
+  StateDual[1] = (s1 & r0) | (s2 & r1) | (s3 & r2) | (s0 & r3);
+  StateDual[2] = (s2 & r0) | (s3 & r1) | (s0 & r2) | (s1 & r3);
+  StateDual[3] = (s3 & r0) | (s0 & r1) | (s1 & r2) | (s2 & r3);
+}
+
+static void SubBytesDual(void)
+{
+  uint64_t w, o;
+  uint8_t i, sh;
+  for (i = 0; i < 4; i++)
+  {
+    w = StateDual[i];
+    o = 0;
+    for (sh = 0; sh < 32; sh += 8)
+    {
+      o |= (uint64_t)SboxMasked[(w >> sh) & 0xff] << sh;
+      o |= (uint64_t)SboxMaskedB[(w >> (sh + 32)) & 0xff] << (sh + 32);
+    }
+    StateDual[i] = o;
+  }
+}
+
+// The mask change goes in first, so the state is never left unmasked.
+static void AddRoundKeyDual(uint8_t round, uint64_t mask)
+{
+  const uint8_t* rk = &RoundKey[round * Nb * 4];
+  uint64_t k;
+  uint8_t i;
+  for (i = 0; i < 4; i++)
+  {
+    k = (uint64_t)rk[4 * i] | ((uint64_t)rk[4 * i + 1] << 8) | ((uint64_t)rk[4 * i + 2] << 16) | ((uint64_t)rk[4 * i + 3] << 24);
+    StateDual[i] ^= mask;
+    StateDual[i] ^= k | (k << 32);
+  }
+}
+
+static void RemaskDual(uint64_t mask)
+{
+  uint8_t i;
+  for (i = 0; i < 4; i++)
+  {
+    StateDual[i] ^= mask;
+  }
+}
+
+static void InitMaskingDual(void)
+{
+  uint64_t rows = 0, sin, sout;
+  uint8_t m4a, m5a, m4b, m5b, i;
+
+  g_seed = 0;
+  for (i = 0; i < 4; i++)
+  {
+    g_seed = (g_seed << 8) | (uint8_t)((*state)[i][0] ^ (*state)[i][1] ^ (*state)[i][2] ^ (*state)[i][3]);
+  }
+
+  for (i = 0; i < 64; i += 8)
+  {
+    rows |= (uint64_t)(uint8_t)generateRandom() << i;
+  }
+  m4a = generateRandom();
+  m4b = generateRandom();
+  RandomDelay();
+  m5a = generateRandom();
+  m5b = generateRandom();
+
+  sin = ((uint64_t)m4a * 0x01010101ULL) | ((uint64_t)m4b * 0x01010101ULL << 32);
+  sout = ((uint64_t)m5a * 0x01010101ULL) | ((uint64_t)m5b * 0x01010101ULL << 32);
+
+  // MixColumns maps the row masks of both lanes at once
+  MaskIn = MixColumnDual(rows);
+  MaskKey = MaskIn ^ sin;
+  MaskMix = rows ^ sout;
+  MaskLast = sout;
+
+  for (i = 0;; i++)
+  {
+    SboxMasked[i ^ m4a] = sbox[i] ^ m5a;
+    SboxMaskedB[i ^ m4b] = sbox[i] ^ m5b;
+    if (i == 255)
+    {
+      break;
+    }
+  }
+}
+
+// Cipher is the main function that encrypts the PlainText.
+// Returns AES_ERR_FAULT when the two lanes disagree.
+static uint8_t CipherMaskedDual(void)
+{
+  uint8_t* output = (uint8_t*)state;
+  uint64_t diff = 0, w;
+  uint8_t round, i;
+
+  InitMaskingDual();
+
+  //Plain text masked with m1',m2',m3',m4' in both lanes
+  for (i = 0; i < 4; i++)
+  {
+    w = (uint64_t)output[4 * i] | ((uint64_t)output[4 * i + 1] << 8) | ((uint64_t)output[4 * i + 2] << 16) | ((uint64_t)output[4 * i + 3] << 24);
+    StateDual[i] = MaskIn ^ w;
+    StateDual[i] ^= w << 32;
+  }
+
+  AddRoundKeyDual(0, MaskKey);
+  for (round = 1;; round++)
+  {
+    RandomDelay();
+    SubBytesDual();
+    ShiftRowsDual();
+    if (round == Nr)
+    {
+      break;
+    }
+    RemaskDual(MaskMix);
+    MixColumnsDual();
+    AddRoundKeyDual(round, MaskKey);
+  }
+  AddRoundKeyDual(Nr, MaskLast);
+
+  for (i = 0; i < 4; i++)
+  {
+    diff |= (StateDual[i] ^ (StateDual[i] >> 32)) & LANE_LO;
+  }
+
+  if (diff == 0)
+  {
+    for (i = 0; i < 16; i++)
+    {
+      output[i] = (uint8_t)(StateDual[i / 4] >> (8 * (i % 4)));
+    }
+    memset(StateDual, 0, sizeof(StateDual));
+    return AES_SUCCESS;
+  }
+
+  fault_count++;
+  for (i = 0; i < 16; i++)
+  {
+#if FAULT_RESPONSE == FAULT_RESPONSE_INFECTIVE
+    // Infective: the faulty cipher text is replaced by noise
+    output[i] = generateRandom();
+#else
+    output[i] = 0;
+#endif
+  }
+  memset(StateDual, 0, sizeof(StateDual));
+#if FAULT_RESPONSE == FAULT_RESPONSE_INFECTIVE
+  return AES_SUCCESS;
+#else
+  return AES_ERR_FAULT;
+#endif
+}
+#endif // #if FAULT_DETECTION
+
+#if LOW_RAM
+/*****************************************************************************/
+/* Low-RAM profile:                                                          */
+/*****************************************************************************/
+// First-order masking as in CipherMasked(), without the stored key schedule,
+// the ghost state and the mul_02/mul_03 tables. Each round key is derived
+// from the previous one in a 16-byte buffer that stays masked with 16 mask
+// bytes drawn per block; the plain round keys are never formed.
+
+// Adds the round key masked with km, then takes km off together with the
+// row mask change m.
+static void AddRoundKeyLowRam(const uint8_t rk[16], const uint8_t km[16], const uint8_t m[4])
+{
+  uint8_t i, j, t;
+  for (i = 0; i < 4; i++)
+  {
+    for (j = 0; j < 4; ++j)
+    {
+      t = (*state)[i][j] ^ rk[(i * Nb) + j];
+      MASK_BARRIER(t);
+      (*state)[i][j] = t ^ km[(i * Nb) + j] ^ m[j];
+    }
+  }
+}
+
+static void InitMaskingLowRam(uint8_t mask[10], uint8_t km[16])
+{
+  uint8_t i;
+
+  g_seed = 0;
+  for (i = 0; i < 4; i++)
+  {
+    g_seed = (g_seed << 8) | (uint8_t)((*state)[i][0] ^ (*state)[i][1] ^ (*state)[i][2] ^ (*state)[i][3]);
+  }
+  for (i = 0; i < 6; i++)
+  {
+    mask[i] = generateRandom();
+    if (i == 3)
+    {
+      //Delay
+      RandomDelay();
+    }
+  }
+  MixColumnsMask(mask);
+  calcSboxMasked(mask);
+  for (i = 0; i < 16; i++)
+  {
+    km[i] = generateRandom();
+  }
+}
+
+// Cipher is the main function that encrypts the PlainText.
+static void CipherMaskedLowRam(void)
+{
+  uint8_t mask[10];
+  uint8_t km[16];               // mask of the round key, fresh per block
+  uint8_t km_in[4];             // km of the last word changed to M, for SubWord
+  uint8_t rk[16];               // round key, masked with km
+  uint8_t m_mid[4], m_last[4];  // state mask changes in AddRoundKeyLowRam()
+  const uint8_t m_none[4] = { 0, 0, 0, 0 };
+  uint8_t round, i;
+
+  InitMaskingLowRam(mask, km);
+  for (i = 0; i < KEYLEN; i++)
+  {
+    rk[i] = km[i];
+    rk[i] ^= CipherKey[i];
+  }
+  for (i = 0; i < 4; i++)
+  {
+    m_mid[i] = mask[6 + i] ^ mask[4];
+    m_last[i] = mask[5];
+    km_in[i] = km[12 + i] ^ mask[4];
+    MASK_BARRIER(km_in[i]);
+  }
+
+  // Plain text masked with M, then the first round key
+  remask(state, mask[4], mask[4], mask[4], mask[4], 0, 0, 0, 0);
+  AddRoundKeyLowRam(rk, km, m_none);
+
+  for (round = 1;; round++)
+  {
+    RandomDelay();
+    // Mask changes from M to M'
+    SubBytesMasked();
+    ShiftRows();
+    NextRoundKey(rk, km, km_in, mask, round);
+    if (round == Nr)
+    {
+      break;
+    }
+    // M' to M1,M2,M3,M4, then MixColumns gives M1',M2',M3',M4'
+    remask(state, mask[0], mask[1], mask[2], mask[3], mask[5], mask[5], mask[5], mask[5]);
+    MixColumns();
+    // The round key, and M1',M2',M3',M4' to M
+    AddRoundKeyLowRam(rk, km, m_mid);
+  }
+
+  // Last round key, and M' is removed
+  AddRoundKeyLowRam(rk, km, m_last);
+
+  wipe(rk, sizeof(rk));
+  wipe(km, sizeof(km));
+  wipe(km_in, sizeof(km_in));
+  wipe(mask, sizeof(mask));
+  wipe(m_mid, sizeof(m_mid));
+  wipe(m_last, sizeof(m_last));
+}
+#endif // #if LOW_RAM
+
+
+
+// Cipher is the main function that encrypts the PlainText.
+#ifndef SECURE
+static void Cipher(void)
+{
+  uint8_t round = 0;
+
+  // Add the First round key to the state before starting the rounds.
+  AddRoundKey(0);
+
+  // There will be Nr rounds.
+  // The first Nr-1 rounds are identical.
+  // These Nr rounds are executed in the loop below.
+  // Last one without MixColumns()
+  for (round = 1;; ++round)
+  {
+    SubBytes();
+    ShiftRows();
+    if (round == Nr)
+    {
+      break;
+    }
+    MixColumns();
+    AddRoundKey(round);
+  }
+  // Add round key to last round
+  AddRoundKey(Nr);
+}
+#endif
+
+
+void AES128_core_lock(void)
+{
+#if AES_CORE_LOCK
+  pthread_mutex_lock(&core_lock);
+#endif
+}
+
+void AES128_core_unlock(void)
+{
+#if AES_CORE_LOCK
+  pthread_mutex_unlock(&core_lock);
+#endif
+}
+
+uint32_t AES128_ECB_indp_key_serial(void)
+{
+  return key_serial;
+}
+
+void AES128_ECB_indp_setkey(uint8_t* key)
+{
+  key_serial++;
+#if LOW_RAM
+  memcpy(CipherKey, key, KEYLEN);
+#else
+  Key = key;
+  KeyExpansion();
+#endif
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+  ScheduleMasked = 0;
+#endif
+}
+
+/*****************************************************************************/
+/* Batched key expansion:                                                    */
+/*****************************************************************************/
+// Mask bytes a schedule is written under, in the layout of RoundKeyMasked:
+// row b of rounds 0..Nr-1 under M(b+1)' ^ M, the last round under M'.
+// mask6 is a set M1..M4, M, M', or NULL for a plain schedule.
+static void ScheduleMasks(const uint8_t* mask6, uint8_t mid[4], uint8_t* last)
+{
+  uint8_t m[10];
+  uint8_t b;
+
+  if (mask6 == NULL)
+  {
+    memset(mid, 0, 4);
+    *last = 0;
+    return;
+  }
+  memcpy(m, mask6, 6);
+  MixColumnsMask(m);
+  for (b = 0; b < 4; ++b)
+  {
+    mid[b] = m[6 + b] ^ m[4];
+  }
+  *last = m[5];
+  wipe(m, sizeof(m));
+}
+
+#ifdef KEY_BATCH_AESNI
+// One key per 128-bit lane, AES_KEY_BATCH_LANES lanes in flight. SubWord runs
+// on the AES unit: with RotWord(w3) copied into all four columns, ShiftRows
+// is a no-op and AESENCLAST computes SubWord(RotWord(w3)) ^ Rcon in every
+// word. The lanes do not depend on each other, so their rounds overlap.
+static void KeyExpansionBatch(const uint8_t* keys, uint8_t* schedules, uint32_t n, const uint8_t* masks)
+{
+  const __m128i rot_w3 = _mm_setr_epi8(13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, 12);
+  __m128i k[AES_KEY_BATCH_LANES], m_mid[AES_KEY_BATCH_LANES], m_last[AES_KEY_BATCH_LANES];
+  __m128i t;
+  uint8_t mid[4], last;
+  uint32_t word;
+  uint8_t round;
+  uint32_t l;
+
+  for (l = 0; l < n; ++l)
+  {
+    ScheduleMasks(masks ? masks + (l * 6) : NULL, mid, &last);
+    memcpy(&word, mid, 4);
+    m_mid[l] = _mm_set1_epi32((int)word);
+    m_last[l] = _mm_set1_epi8((char)last);
+    k[l] = _mm_loadu_si128((const __m128i*)(keys + (l * KEYLEN)));
+    _mm_storeu_si128((__m128i*)(schedules + (l * AES_keyExpSize)), _mm_xor_si128(k[l], m_mid[l]));
+  }
+
+  for (round = 1; round <= Nr; ++round)
+  {
+    for (l = 0; l < n; ++l)
+    {
+      t = _mm_aesenclast_si128(_mm_shuffle_epi8(k[l], rot_w3), _mm_set1_epi32(Rcon[round]));
+      k[l] = _mm_xor_si128(k[l], _mm_slli_si128(k[l], 4));
+      k[l] = _mm_xor_si128(k[l], _mm_slli_si128(k[l], 8));
+      k[l] = _mm_xor_si128(k[l], t);
+      _mm_storeu_si128((__m128i*)(schedules + (l * AES_keyExpSize) + (round * Nb * 4)),
+                       _mm_xor_si128(k[l], (round < Nr) ? m_mid[l] : m_last[l]));
+    }
+  }
+
+  wipe(k, sizeof(k));
+  wipe(m_mid, sizeof(m_mid));
+  wipe(m_last, sizeof(m_last));
+}
+#else
+// Portable: the lanes advance through the rounds together, each key held as
+// four 32-bit column words. The S-box lookups of different keys do not
+// depend on each other, so they overlap in the pipeline the way the AES-NI
+// lanes do, where one key alone is a chain of dependent lookups.
+static void KeyExpansionBatch(const uint8_t* keys, uint8_t* schedules, uint32_t n, const uint8_t* masks)
+{
+  uint32_t w[AES_KEY_BATCH_LANES][4];
+  uint32_t m_mid[AES_KEY_BATCH_LANES], m_last[AES_KEY_BATCH_LANES];
+  uint8_t mid[4], last, sub[4];
+  const uint8_t* b;
+  uint8_t* out;
+  uint32_t l, t, m;
+  uint8_t round, i;
+
+  for (l = 0; l < n; ++l)
+  {
+    ScheduleMasks(masks ? masks + (l * 6) : NULL, mid, &last);
+    memcpy(&m_mid[l], mid, 4);
+    m_last[l] = last * 0x01010101u;
+    memcpy(w[l], keys + (l * KEYLEN), KEYLEN);
+    out = schedules + (l * AES_keyExpSize);
+    for (i = 0; i < 4; ++i)
+    {
+      t = w[l][i] ^ m_mid[l];
+      memcpy(out + (i * 4), &t, 4);
+    }
+  }
+
+  for (round = 1; round <= Nr; ++round)
+  {
+    for (l = 0; l < n; ++l)
+    {
+      // SubWord(RotWord(w3)) ^ Rcon, then the running XOR over the words
+      b = (const uint8_t*)w[l];
+      sub[0] = getSBoxValue(b[13]) ^ Rcon[round];
+      sub[1] = getSBoxValue(b[14]);
+      sub[2] = getSBoxValue(b[15]);
+      sub[3] = getSBoxValue(b[12]);
+      memcpy(&t, sub, 4);
+      w[l][0] ^= t;
+      w[l][1] ^= w[l][0];
+      w[l][2] ^= w[l][1];
+      w[l][3] ^= w[l][2];
+
+      m = (round < Nr) ? m_mid[l] : m_last[l];
+      out = schedules + (l * AES_keyExpSize) + (round * Nb * 4);
+      for (i = 0; i < 4; ++i)
+      {
+        t = w[l][i] ^ m;
+        memcpy(out + (i * 4), &t, 4);
+      }
+    }
+  }
+
+  wipe(w, sizeof(w));
+  wipe(sub, sizeof(sub));
+  wipe(&t, sizeof(t));
+  wipe(m_mid, sizeof(m_mid));
+  wipe(m_last, sizeof(m_last));
+}
+#endif
+
+void AES128_key_expansion_batch(const uint8_t* keys, uint8_t* schedules, uint32_t n, const uint8_t* masks)
+{
+  uint32_t done, lanes;
+
+  for (done = 0; done < n; done += lanes)
+  {
+    lanes = (n - done < AES_KEY_BATCH_LANES) ? n - done : AES_KEY_BATCH_LANES;
+    KeyExpansionBatch(keys + (done * KEYLEN), schedules + (done * AES_keyExpSize), lanes,
+                      masks ? masks + (done * 6) : NULL);
+  }
+}
+
+#if !LOW_RAM
+void AES128_ECB_indp_load_schedule(const uint8_t* schedule)
+{
+  key_serial++;
+  memcpy(RoundKey, schedule, AES_keyExpSize);
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+  ScheduleMasked = 0;
+#endif
+}
+#endif
+
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+void AES128_ECB_indp_load_masked_schedule(const uint8_t* schedule, const uint8_t* mask)
+{
+  key_serial++;
+  memcpy(RoundKeyMasked, schedule, AES_keyExpSize);
+  memcpy(ScheduleMask, mask, 6);
+  MixColumnsMask(ScheduleMask);
+  ScheduleMasked = 1;
+  // The plain schedule of an earlier key must not stay behind
+  wipe(RoundKey, sizeof(RoundKey));
+  Key = NULL;
+}
+#endif
+
+void AES_wipe(void* buf, size_t len)
+{
+  wipe(buf, len);
+}
+
+void AES128_ECB_indp_wipe(void)
+{
+  key_serial++;
+#if LOW_RAM
+  wipe(CipherKey, sizeof(CipherKey));
+#else
+  wipe(RoundKey, sizeof(RoundKey));
+  Key = NULL;
+#endif
+#if MASKING_ORDER == 1 && !FAULT_DETECTION && !LOW_RAM
+  wipe(RoundKeyMasked, sizeof(RoundKeyMasked));
+  wipe(ScheduleMask, sizeof(ScheduleMask));
+  ScheduleMasked = 0;
+#endif
+}
+
+#if FAULT_DETECTION
+uint32_t AES128_ECB_indp_faults(void)
+{
+  return fault_count;
+}
+#endif
+
+uint8_t AES128_ECB_indp_crypto(uint8_t* input)
+{
+	uint8_t status = AES_SUCCESS;
+
+	state = (state_t*)input;
+	
+#if MASKING_ORDER > 1
+	CipherMaskedShares();
+#elif FAULT_DETECTION
+	status = CipherMaskedDual();
+#elif LOW_RAM
+	CipherMaskedLowRam();
+#else
+	state_yat = (state_y*)malloc(sizeof(state_y));
+	// Check if memory allocation was successful
+	if (state == NULL || state_yat == NULL)
+	{
+		return AES_ERR_MEMORY;
+	}
+	
+	memcpy(state_yat, input, sizeof(state_y));
+	
+#ifdef SECURE 
+	CipherMasked();
+#else 
+	Cipher();
+#endif
+	
+	free(state_yat);
+#endif
+	return status;
 }
\ No newline at end of file
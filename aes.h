@@ -1,6 +1,7 @@
 #ifndef _AES_H_
 #define _AES_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 // #define the macros below to 1/0 to enable/disable the mode of operation.
@@ -24,6 +25,106 @@
 
 //#define MASKED 0
 
+// Masking order of the cipher core: each state byte is carried in
+// MASKING_ORDER + 1 shares. 1 selects the first-order engine with the masked
+// S-box table; 2 and above select the ISW share-based engine.
+// The masks and gadget randoms come from a 32-bit LCG seeded from the plain
+// text, so every share is a function of the input: the order only holds once
+// generateRandom() in aes.c is backed by a real RNG.
+#ifndef MASKING_ORDER
+  #define MASKING_ORDER 1
+#endif
+
+// Timing desynchronization, both driven by the mask PRNG:
+// RANDOM_DELAY_MAX is the largest number of dummy iterations inserted before
+// each round (0 disables it). An iteration is one dependent xtime/XOR step,
+// about 6 cycles on x86-64 at -O2. A block draws 10 to 12 delays depending
+// on the engine, so the mean cost is about 36 * RANDOM_DELAY_MAX cycles per
+// block: 32 adds some 1100 cycles, about 40% of the default build. Other
+// targets can calibrate it with aes_bench. DUMMY_ROUNDS full dummy rounds are
+// spread over random positions of every encryption, costing about 1/Nr of
+// the cipher each. Dummy rounds need the first-order engine.
+#ifndef RANDOM_DELAY_MAX
+  #define RANDOM_DELAY_MAX 0
+#endif
+
+#ifndef DUMMY_ROUNDS
+  #define DUMMY_ROUNDS 0
+#endif
+
+#if (DUMMY_ROUNDS > 0) && (MASKING_ORDER > 1)
+  #error "DUMMY_ROUNDS is only supported with MASKING_ORDER 1"
+#endif
+
+// Fault detection: with FAULT_DETECTION set to 1 every block is encrypted
+// twice, in two lanes of one 64-bit word under independent masks, and the
+// results are compared. FAULT_RESPONSE selects what a mismatch does:
+// FAULT_RESPONSE_ERROR clears the block and returns AES_ERR_FAULT,
+// FAULT_RESPONSE_INFECTIVE replaces it with random bytes and reports success.
+// Either way AES128_ECB_indp_faults() counts it.
+// The lanes share the word-wide linear layer and this build leaves out the
+// decoy ghost state, so the second lane costs little more than its S-box
+// lookups. With aes_bench (GCC 12, -O2, one-core x86-64 VM), eight runs
+// alternated with the default build gave a minimum of 1926 to 2040 cycles
+// per block against 1892 to 2206, and medians within about 10% in all but
+// the two noisiest pairs.
+#define FAULT_RESPONSE_ERROR     1
+#define FAULT_RESPONSE_INFECTIVE 2
+
+#ifndef FAULT_DETECTION
+  #define FAULT_DETECTION 0
+#endif
+
+#ifndef FAULT_RESPONSE
+  #define FAULT_RESPONSE FAULT_RESPONSE_ERROR
+#endif
+
+#if FAULT_DETECTION && (MASKING_ORDER > 1)
+  #error "FAULT_DETECTION is only supported with MASKING_ORDER 1"
+#endif
+
+// The dummy rounds run the single-lane round of the first-order engine,
+// which would not look like a dual-lane round at all.
+#if FAULT_DETECTION && (DUMMY_ROUNDS > 0)
+  #error "DUMMY_ROUNDS is not supported with FAULT_DETECTION"
+#endif
+
+// Low-RAM profile: with LOW_RAM set to 1 only the 16-byte cipher key is kept
+// per key. The round keys are computed round by round during encryption,
+// masked throughout with 16 mask bytes drawn per block and wiped after it.
+// MixColumns masks use xtime() instead of the mul_02/mul_03
+// tables, and the decoy ghost state is left out. First-order masking only.
+#ifndef LOW_RAM
+  #define LOW_RAM 0
+#endif
+
+#if LOW_RAM && ((MASKING_ORDER > 1) || FAULT_DETECTION || (DUMMY_ROUNDS > 0))
+  #error "LOW_RAM excludes MASKING_ORDER > 1, FAULT_DETECTION and DUMMY_ROUNDS"
+#endif
+
+// Number of keys AES128_key_expansion_batch() works on at once: 4, 8 or 16,
+// to match the SIMD width of the target.
+#ifndef AES_KEY_BATCH_LANES
+  #define AES_KEY_BATCH_LANES 16
+#endif
+
+// The core lock, AES128_core_lock(), is a pthread mutex on hosted POSIX
+// targets. Set AES_CORE_LOCK to 0 where there are no threads (or pthreads);
+// the lock calls then do nothing.
+#ifndef AES_CORE_LOCK
+  #if defined(__unix__) || defined(__APPLE__)
+    #define AES_CORE_LOCK 1
+  #else
+    #define AES_CORE_LOCK 0
+  #endif
+#endif
+
+// Storage class of the constant lookup tables in aes.c. Targets that need the
+// tables in a specific section (e.g. PROGMEM on AVR) can override it.
+#ifndef AES_CONST_VAR
+  #define AES_CONST_VAR static const
+#endif
+
 #define AES128 1
 //#define AES192 1
 //#define AES256 1
@@ -41,6 +142,10 @@
     #define AES_keyExpSize 176
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct AES_ctx
 {
   uint8_t RoundKey[AES_keyExpSize];
@@ -88,4 +193,62 @@ void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 #endif // #if defined(CTR) && (CTR == 1)
 
 
+// Masked AES-128 core (aes.c).
+// The key schedule and the cipher state live in file-scope variables, so only
+// one key is active at a time and calls must not run concurrently.
+// Code that shares the core between threads (aes_ctr_cache.c, aes_masked.hpp)
+// holds the core lock from loading its key until its last block is done.
+void AES128_core_lock(void);
+void AES128_core_unlock(void);
+// Changes whenever a key is loaded into the core, so a caller holding the
+// lock can tell whether the schedule it loaded last is still there.
+uint32_t AES128_ECB_indp_key_serial(void);
+
+void AES128_ECB_indp_setkey(uint8_t* key);
+// buffer size is exactly AES_BLOCKLEN bytes, encrypted in place
+// returns AES_SUCCESS, or one of the AES_ERR_* codes below
+uint8_t AES128_ECB_indp_crypto(uint8_t* input);
+
+// Clears the key schedule (or, with LOW_RAM, the cipher key) held by the core.
+void AES128_ECB_indp_wipe(void);
+// Clears len bytes at buf with a store the compiler cannot drop, for key
+// material in callers' buffers.
+void AES_wipe(void* buf, size_t len);
+
+#define AES_SUCCESS    0
+#define AES_ERR_MEMORY 1 // no memory for the cipher state, buffer untouched
+#define AES_ERR_FAULT  2 // fault detected, buffer cleared
+
+#if FAULT_DETECTION
+// number of faults detected since power-up
+uint32_t AES128_ECB_indp_faults(void);
+#endif
+
+// Expands n keys (n * AES_KEYLEN bytes) into n schedules of AES_keyExpSize
+// bytes, AES_KEY_BATCH_LANES keys at a time.
+// masks is NULL for plain schedules, or n mask sets of 6 bytes each
+// (M1..M4, M, M'): each schedule is then written masked the way the core masks
+// RoundKeyMasked, M1'..M4' (MixColumns of M1..M4) being derived here, and the
+// plain one is never stored.
+void AES128_key_expansion_batch(const uint8_t* keys, uint8_t* schedules, uint32_t n, const uint8_t* masks);
+
+#if !LOW_RAM
+// Installs a plain schedule from AES128_key_expansion_batch() in place of
+// AES128_ECB_indp_setkey()
+void AES128_ECB_indp_load_schedule(const uint8_t* schedule);
+#endif
+
+#if (MASKING_ORDER == 1) && !FAULT_DETECTION && !LOW_RAM
+// Installs a masked schedule from AES128_key_expansion_batch() together with
+// its 6-byte mask set. Every block still draws fresh masks: the schedule is
+// moved from the masks of the previous block to the new ones by XORing in
+// their differences, so the plain schedule is never formed.
+void AES128_ECB_indp_load_masked_schedule(const uint8_t* schedule, const uint8_t* mask);
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // _AES_H_
\ No newline at end of file
@@ -0,0 +1,269 @@
+/*
+ * CTR keystream reservoir, see aes_ctr_cache.h.
+ */
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes_ctr_cache.h"
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+// Blocks the worker computes per hold of the core lock. The key schedule is
+// reloaded once per batch.
+#define FILL_BATCH 8
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+// Counter block of sequence number seq: the IV plus seq, big-endian.
+static void counter_block(uint8_t* out, const uint8_t* iv, uint64_t seq)
+{
+  unsigned sum = 0;
+  int i;
+  for (i = AES_BLOCKLEN - 1; i >= 0; --i)
+  {
+    sum += iv[i] + (unsigned)(seq & 0xff);
+    out[i] = (uint8_t)sum;
+    sum >>= 8;
+    seq >>= 8;
+  }
+}
+
+// Encrypts n consecutive counter blocks starting at seq. *serial gets the
+// key serial of the core after the key was loaded.
+static uint8_t keystream(uint8_t* out, uint8_t* key, const uint8_t* iv, uint64_t seq, uint32_t n, uint32_t* serial)
+{
+  uint8_t status = AES_SUCCESS;
+  uint32_t i;
+
+  AES128_core_lock();
+  AES128_ECB_indp_setkey(key);
+  *serial = AES128_ECB_indp_key_serial();
+  for (i = 0; i < n && status == AES_SUCCESS; ++i)
+  {
+    counter_block(out + i * AES_BLOCKLEN, iv, seq + i);
+    status = AES128_ECB_indp_crypto(out + i * AES_BLOCKLEN);
+  }
+  AES128_core_unlock();
+  return status;
+}
+
+// Wipes the core schedule if it still is the last one this context loaded.
+static void wipe_core(struct AES_ctr_cache* c)
+{
+  AES128_core_lock();
+  if (c->core_serial == AES128_ECB_indp_key_serial())
+  {
+    AES128_ECB_indp_wipe();
+  }
+  AES128_core_unlock();
+}
+
+static void wipe_reservoir(struct AES_ctr_cache* c)
+{
+  AES_wipe(c->ring, (size_t)c->high * AES_BLOCKLEN);
+  AES_wipe(c->block, AES_BLOCKLEN);
+  c->block_used = AES_BLOCKLEN;
+  c->head = 0;
+  c->count = 0;
+  c->head_seq = 0;
+  c->generation++;
+  c->filling = 1;
+  pthread_cond_broadcast(&c->cond);
+}
+
+static void* worker_main(void* arg)
+{
+  struct AES_ctr_cache* c = arg;
+  uint8_t ks[FILL_BATCH * AES_BLOCKLEN];
+  uint8_t key[AES_KEYLEN], iv[AES_BLOCKLEN];
+  uint64_t seq, fill_seq, skip;
+  uint32_t gen, n, i, room;
+
+  pthread_mutex_lock(&c->lock);
+  while (!c->stop)
+  {
+    if (!c->filling)
+    {
+      pthread_cond_wait(&c->cond, &c->lock);
+      continue;
+    }
+
+    // Snapshot what to compute, then run the core without the context lock
+    // so the owner keeps consuming meanwhile.
+    gen = c->generation;
+    seq = c->head_seq + c->count;
+    n = c->high - c->count;
+    n = (n < FILL_BATCH) ? n : FILL_BATCH;
+    memcpy(key, c->Key, AES_KEYLEN);
+    memcpy(iv, c->Iv, AES_BLOCKLEN);
+    pthread_mutex_unlock(&c->lock);
+
+    if (keystream(ks, key, iv, seq, n, &c->core_serial) != AES_SUCCESS)
+    {
+      n = 0; // the owner will hit the error itself on the miss
+    }
+
+    pthread_mutex_lock(&c->lock);
+    fill_seq = c->head_seq + c->count;
+    if (gen == c->generation && fill_seq >= seq && fill_seq < seq + n)
+    {
+      // Misses may have consumed the first blocks of the batch meanwhile.
+      skip = fill_seq - seq;
+      room = c->high - c->count;
+      for (i = (uint32_t)skip; i < n && room > 0; ++i, --room)
+      {
+        memcpy(c->ring + ((c->head + c->count) % c->high) * AES_BLOCKLEN, ks + i * AES_BLOCKLEN, AES_BLOCKLEN);
+        c->count++;
+      }
+    }
+    if (c->count >= c->high || n == 0)
+    {
+      c->filling = 0;
+    }
+    AES_wipe(ks, sizeof(ks));
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  AES_wipe(key, sizeof(key));
+  AES_wipe(iv, sizeof(iv));
+  return NULL;
+}
+
+// Loads the next keystream block into c->block. Called with c->lock held.
+static uint8_t next_block(struct AES_ctr_cache* c)
+{
+  uint8_t status = AES_SUCCESS;
+
+  if (c->count > 0)
+  {
+    memcpy(c->block, c->ring + c->head * AES_BLOCKLEN, AES_BLOCKLEN);
+    AES_wipe(c->ring + c->head * AES_BLOCKLEN, AES_BLOCKLEN);
+    c->head = (c->head + 1) % c->high;
+    c->count--;
+    c->hits++;
+  }
+  else
+  {
+    // The worker is behind: compute this block here. A batch it has in
+    // flight keeps whatever part of it is still ahead of the counter.
+    status = keystream(c->block, c->Key, c->Iv, c->head_seq, 1, &c->core_serial);
+    c->misses++;
+  }
+  if (status == AES_SUCCESS)
+  {
+    c->head_seq++;
+    c->block_used = 0;
+  }
+  if (!c->filling && c->count < c->low)
+  {
+    c->filling = 1;
+    pthread_cond_broadcast(&c->cond);
+  }
+  return status;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int AES_ctr_cache_init(struct AES_ctr_cache* c, const uint8_t* key, const uint8_t* iv, uint32_t low, uint32_t high)
+{
+  memset(c, 0, sizeof(*c));
+  if (low == 0 || low > high)
+  {
+    return -1;
+  }
+  c->ring = calloc(high, AES_BLOCKLEN);
+  if (c->ring == NULL)
+  {
+    return -1;
+  }
+  memcpy(c->Key, key, AES_KEYLEN);
+  memcpy(c->Iv, iv, AES_BLOCKLEN);
+  c->low = low;
+  c->high = high;
+  c->block_used = AES_BLOCKLEN;
+  c->filling = 1;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  if (pthread_create(&c->worker, NULL, worker_main, c) != 0)
+  {
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free(c->ring);
+    AES_wipe(c, sizeof(*c));
+    return -1;
+  }
+  return 0;
+}
+
+void AES_ctr_cache_free(struct AES_ctr_cache* c)
+{
+  pthread_mutex_lock(&c->lock);
+  c->stop = 1;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->worker, NULL);
+  wipe_core(c);
+
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->lock);
+  AES_wipe(c->ring, (size_t)c->high * AES_BLOCKLEN);
+  free(c->ring);
+  AES_wipe(c, sizeof(*c));
+}
+
+void AES_ctr_cache_set_key(struct AES_ctr_cache* c, const uint8_t* key, const uint8_t* iv)
+{
+  pthread_mutex_lock(&c->lock);
+  // The old key must not stay behind in the core either
+  wipe_core(c);
+  memcpy(c->Key, key, AES_KEYLEN);
+  memcpy(c->Iv, iv, AES_BLOCKLEN);
+  wipe_reservoir(c);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void AES_ctr_cache_set_iv(struct AES_ctr_cache* c, const uint8_t* iv)
+{
+  pthread_mutex_lock(&c->lock);
+  memcpy(c->Iv, iv, AES_BLOCKLEN);
+  wipe_reservoir(c);
+  pthread_mutex_unlock(&c->lock);
+}
+
+uint8_t AES_ctr_cache_xcrypt(struct AES_ctr_cache* c, uint8_t* buf, uint32_t length)
+{
+  uint8_t status = AES_SUCCESS;
+  uint32_t i;
+
+  pthread_mutex_lock(&c->lock);
+  for (i = 0; i < length; ++i)
+  {
+    if (c->block_used == AES_BLOCKLEN)
+    {
+      status = next_block(c);
+      if (status != AES_SUCCESS)
+      {
+        break;
+      }
+    }
+    buf[i] ^= c->block[c->block_used++];
+  }
+  pthread_mutex_unlock(&c->lock);
+  return status;
+}
+
+void AES_ctr_cache_stats(struct AES_ctr_cache* c, uint64_t* hits, uint64_t* misses)
+{
+  pthread_mutex_lock(&c->lock);
+  *hits = c->hits;
+  *misses = c->misses;
+  pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,81 @@
+#ifndef _AES_CTR_CACHE_H_
+#define _AES_CTR_CACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "aes.h"
+
+#if !AES_CORE_LOCK
+  #error "aes_ctr_cache needs the core lock, build with AES_CORE_LOCK 1"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CTR keystream reservoir on top of the masked AES-128 core.
+//
+// A background thread per context computes keystream ahead of the counter:
+// whenever fewer than `low` blocks are left it refills the reservoir up to
+// `high` blocks. AES_ctr_cache_xcrypt() then only XORs precomputed keystream
+// into the buffer (a hit); if the reservoir runs dry it computes the block
+// itself (a miss).
+//
+// Changing the key or the IV wipes the reservoir, and blocks that were being
+// computed for the old ones are discarded. Changing the key or freeing the
+// context also wipes the schedule in the core if it still is this context's.
+//
+// The core keeps its state in globals. Every context runs it under the core
+// lock (AES128_core_lock()), as does aes_masked.hpp; other code calling
+// AES128_ECB_indp_* while contexts are alive must take it as well.
+// A context itself must not be used from several threads at once; only its
+// worker runs concurrently with the owner.
+
+struct AES_ctr_cache
+{
+  uint8_t  Key[AES_KEYLEN];
+  uint8_t  Iv[AES_BLOCKLEN];   // counter block of sequence number 0
+
+  uint8_t* ring;               // high * AES_BLOCKLEN bytes of keystream
+  uint32_t low, high;          // watermarks, in blocks
+  uint32_t head;               // ring index of the oldest ready block
+  uint32_t count;              // ready blocks
+  uint64_t head_seq;           // sequence number of the block at head
+  uint32_t generation;         // bumped by every key/IV change
+  int      filling;
+  int      stop;
+
+  uint8_t  block[AES_BLOCKLEN]; // keystream block being consumed
+  uint8_t  block_used;          // bytes of it already used, 16 = none
+
+  uint64_t hits, misses;       // in blocks
+  uint32_t core_serial;        // key serial of the core after this context's
+                               // last key load, only used under the core lock
+
+  pthread_t       worker;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+};
+
+// Starts the worker. 1 <= low <= high. Returns 0, or -1 if out of resources.
+int  AES_ctr_cache_init(struct AES_ctr_cache* c, const uint8_t* key, const uint8_t* iv, uint32_t low, uint32_t high);
+// Stops the worker and wipes the context.
+void AES_ctr_cache_free(struct AES_ctr_cache* c);
+
+// Both restart the counter at the IV and wipe the reservoir.
+void AES_ctr_cache_set_key(struct AES_ctr_cache* c, const uint8_t* key, const uint8_t* iv);
+void AES_ctr_cache_set_iv(struct AES_ctr_cache* c, const uint8_t* iv);
+
+// Same function for encrypting as for decrypting, any length.
+// Returns AES_SUCCESS or the AES_ERR_* code of the core on a miss.
+uint8_t AES_ctr_cache_xcrypt(struct AES_ctr_cache* c, uint8_t* buf, uint32_t length);
+
+// Hit/miss counters, in blocks, since init.
+void AES_ctr_cache_stats(struct AES_ctr_cache* c, uint64_t* hits, uint64_t* misses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _AES_CTR_CACHE_H_
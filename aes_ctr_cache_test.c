@@ -0,0 +1,220 @@
+/*
+ * Compile-and-run test of aes_ctr_cache.c.
+ *
+ *   cc -O2 -pthread aes_ctr_cache_test.c aes_ctr_cache.c aes.c -o aes_ctr_cache_test && ./aes_ctr_cache_test
+ *
+ * Encrypts the SP 800-38A F.5.1 CTR-AES128 vector in calls of random lengths
+ * under several watermarks, runs the counter across a carry, changes the IV
+ * and the key part way through a block, checks that the hit and miss
+ * counters add up to the keystream blocks used and that freeing a context
+ * takes its key schedule out of the core.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "aes_ctr_cache.h"
+
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+static const uint8_t plain[64] = {
+  0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+  0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+  0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+  0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+static const uint8_t cipher[64] = {
+  0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+  0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+  0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+  0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee };
+
+static int failures = 0;
+static uint32_t seed = 1;
+
+static void expect(int ok, const char* what)
+{
+  if (!ok)
+  {
+    printf("FAILURE: %s\n", what);
+    failures++;
+  }
+}
+
+// 1 to max, from a fixed sequence so a failure can be reproduced
+static uint32_t random_len(uint32_t max)
+{
+  seed = seed * 1103515245u + 12345u;
+  return 1 + (seed >> 16) % max;
+}
+
+// Keystream of nblocks counter blocks from ctr, through the core directly.
+static void reference(uint8_t* out, const uint8_t* k, const uint8_t* ctr, uint32_t nblocks)
+{
+  uint8_t c[16], kk[16];
+  uint32_t b;
+  int i;
+
+  memcpy(c, ctr, 16);
+  memcpy(kk, k, 16);
+  AES128_core_lock();
+  AES128_ECB_indp_setkey(kk);
+  for (b = 0; b < nblocks; ++b)
+  {
+    memcpy(out + 16 * b, c, 16);
+    AES128_ECB_indp_crypto(out + 16 * b);
+    for (i = 15; i >= 0 && ++c[i] == 0; --i)
+    {
+    }
+  }
+  AES128_core_unlock();
+}
+
+// Encrypts len bytes in calls of random lengths. Returns the status of the
+// last call.
+static uint8_t xcrypt_random(struct AES_ctr_cache* c, uint8_t* buf, uint32_t len, uint32_t max_call)
+{
+  uint8_t status = AES_SUCCESS;
+  uint32_t off = 0, n;
+
+  while (off < len && status == AES_SUCCESS)
+  {
+    n = random_len(max_call);
+    n = (n < len - off) ? n : len - off;
+    status = AES_ctr_cache_xcrypt(c, buf + off, n);
+    off += n;
+  }
+  return status;
+}
+
+static void check_stats(struct AES_ctr_cache* c, uint64_t blocks, const char* what)
+{
+  uint64_t hits, misses;
+  AES_ctr_cache_stats(c, &hits, &misses);
+  expect(hits + misses == blocks, what);
+}
+
+static void test_vector(uint32_t low, uint32_t high)
+{
+  struct AES_ctr_cache c;
+  uint8_t buf[64];
+  char what[80];
+  int run;
+
+  if (AES_ctr_cache_init(&c, key, iv, low, high) != 0)
+  {
+    expect(0, "AES_ctr_cache_init()");
+    return;
+  }
+  for (run = 0; run < 50; ++run)
+  {
+    memcpy(buf, plain, 64);
+    AES_ctr_cache_set_iv(&c, iv);
+    expect(xcrypt_random(&c, buf, 64, 23) == AES_SUCCESS, "xcrypt() status");
+    snprintf(what, sizeof(what), "F.5.1 vector, watermarks %u/%u, run %d", low, high, run);
+    expect(memcmp(buf, cipher, 64) == 0, what);
+  }
+  snprintf(what, sizeof(what), "hits + misses, watermarks %u/%u", low, high);
+  check_stats(&c, 50 * 4, what);
+  AES_ctr_cache_free(&c);
+}
+
+// The counter runs over the low 64 bits into the high half.
+static void test_carry(void)
+{
+  static const uint8_t carry_iv[16] = { 0, 1, 2, 3, 4, 5, 6, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfd };
+  struct AES_ctr_cache c;
+  uint8_t ks[8 * 16], buf[8 * 16];
+
+  reference(ks, key, carry_iv, 8);
+  if (AES_ctr_cache_init(&c, key, carry_iv, 2, 4) != 0)
+  {
+    expect(0, "AES_ctr_cache_init()");
+    return;
+  }
+  memset(buf, 0, sizeof(buf));
+  expect(xcrypt_random(&c, buf, sizeof(buf), 40) == AES_SUCCESS, "xcrypt() status");
+  expect(memcmp(buf, ks, sizeof(buf)) == 0, "keystream across a counter carry");
+  check_stats(&c, 8, "hits + misses across a counter carry");
+  AES_ctr_cache_free(&c);
+}
+
+// set_iv() and set_key() part way through a block restart the keystream at
+// the new IV, with the partly used block dropped.
+static void test_rekey(void)
+{
+  static const uint8_t key2[16] = { 0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe, 0xef, 0xcd, 0xab, 0x89, 0x67, 0x45, 0x23, 0x01 };
+  static const uint8_t iv2[16] = { 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0xa5, 0, 0, 0, 0, 0, 0, 0, 0xf0 };
+  struct AES_ctr_cache c;
+  uint8_t ks[4 * 16], buf[4 * 16];
+
+  if (AES_ctr_cache_init(&c, key, iv, 1, 8) != 0)
+  {
+    expect(0, "AES_ctr_cache_init()");
+    return;
+  }
+  memcpy(buf, plain, 64);
+  expect(AES_ctr_cache_xcrypt(&c, buf, 21) == AES_SUCCESS, "xcrypt() status");
+  expect(memcmp(buf, cipher, 21) == 0, "first 21 bytes before set_iv()");
+
+  AES_ctr_cache_set_iv(&c, iv2);
+  reference(ks, key, iv2, 4);
+  memset(buf, 0, sizeof(buf));
+  expect(xcrypt_random(&c, buf, 37, 9) == AES_SUCCESS, "xcrypt() status");
+  expect(memcmp(buf, ks, 37) == 0, "keystream after set_iv() mid-block");
+
+  AES_ctr_cache_set_key(&c, key2, iv2);
+  reference(ks, key2, iv2, 4);
+  memset(buf, 0, sizeof(buf));
+  expect(xcrypt_random(&c, buf, sizeof(buf), 17) == AES_SUCCESS, "xcrypt() status");
+  expect(memcmp(buf, ks, sizeof(buf)) == 0, "keystream after set_key() mid-block");
+
+  AES_ctr_cache_set_key(&c, key, iv);
+  memcpy(buf, plain, 64);
+  expect(xcrypt_random(&c, buf, 64, 64) == AES_SUCCESS, "xcrypt() status");
+  expect(memcmp(buf, cipher, 64) == 0, "F.5.1 vector after switching the key back");
+
+  // 2 blocks for 21 bytes, 3 for 37, 4 and 4
+  check_stats(&c, 2 + 3 + 4 + 4, "hits + misses across set_iv()/set_key()");
+  AES_ctr_cache_free(&c);
+}
+
+// Freeing a context wipes its schedule from the core.
+static void test_free_wipes_core(void)
+{
+  struct AES_ctr_cache c;
+  uint8_t buf[16], ks[16], out[16];
+
+  reference(ks, key, iv, 1);
+  if (AES_ctr_cache_init(&c, key, iv, 1, 1) != 0)
+  {
+    expect(0, "AES_ctr_cache_init()");
+    return;
+  }
+  memset(buf, 0, 16);
+  AES_ctr_cache_xcrypt(&c, buf, 16);
+  AES_ctr_cache_free(&c);
+
+  // Whatever the core holds now, it no longer encrypts under the key
+  memcpy(out, iv, 16);
+  AES128_core_lock();
+  AES128_ECB_indp_crypto(out);
+  AES128_core_unlock();
+  expect(memcmp(out, ks, 16) != 0, "free() wipes the core schedule");
+}
+
+int main(void)
+{
+  test_vector(1, 1);
+  test_vector(1, 4);
+  test_vector(3, 16);
+  test_vector(64, 64);
+  test_carry();
+  test_rekey();
+  test_free_wipes_core();
+
+  if (failures == 0)
+  {
+    printf("aes_ctr_cache: all checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+#ifndef _AES_MASKED_HPP_
+#define _AES_MASKED_HPP_
+
+// Header-only C++20 interface to the masked AES-128 core in aes.c.
+//
+//   aes_masked::masked_aes<128> aes(key);      // key: std::span<const uint8_t, 16>
+//   aes.encrypt(block);                        // one block, in place
+//   aes.encrypt_blocks(blocks);                // whole blocks, in place
+//
+// The profile (masking order, fault detection, low RAM) is fixed when aes.c
+// is compiled. The Profile parameter names the one the caller relies on and
+// is checked against that build at compile time, so asking for a protection
+// the linked core does not have fails to compile instead of running without
+// it.
+//
+// The core keeps one key schedule and the cipher state in globals. Calls from
+// all contexts run under the core lock of aes.c, AES128_core_lock(), which
+// aes_ctr_cache.c takes as well. The key schedule is only reloaded when a key
+// was loaded into the core since this context last loaded its own. Other code
+// calling AES128_ECB_indp_* alongside it must hold the core lock.
+//
+// A context zeroizes its copy of the key when it is destroyed or assigned
+// over, and wipes the schedule in the core too if that is still its own.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+
+#include "aes.h"
+
+#if !AES_CORE_LOCK
+  #error "aes_masked needs the core lock, build with AES_CORE_LOCK 1"
+#endif
+
+namespace aes_masked {
+
+namespace profile {
+  // First-order table masking with the decoy ghost state (default build).
+  struct first_order {};
+  // MASKING_ORDER = Order, Order + 1 shares per byte.
+  template <int Order> struct higher_order {};
+  // FAULT_DETECTION = 1, two masked lanes compared on every block.
+  struct fault_detection {};
+  // LOW_RAM = 1, round keys derived during encryption.
+  struct low_ram {};
+}
+
+// The profile aes.c is built with, from the same macros it sees.
+#if MASKING_ORDER > 1
+using build_profile = profile::higher_order<MASKING_ORDER>;
+#elif FAULT_DETECTION
+using build_profile = profile::fault_detection;
+#elif LOW_RAM
+using build_profile = profile::low_ram;
+#else
+using build_profile = profile::first_order;
+#endif
+
+// Thrown when the core reports a detected fault or cannot allocate its state.
+class core_error : public std::runtime_error
+{
+public:
+  explicit core_error(uint8_t status)
+    : std::runtime_error(status == AES_ERR_FAULT ? "aes_masked: fault detected" : "aes_masked: out of memory"),
+      status_(status) {}
+  uint8_t status() const noexcept { return status_; }
+private:
+  uint8_t status_;
+};
+
+namespace detail {
+  // Holds the core lock for its lifetime.
+  class core_guard
+  {
+  public:
+    core_guard() noexcept { AES128_core_lock(); }
+    ~core_guard() { AES128_core_unlock(); }
+    core_guard(const core_guard&) = delete;
+    core_guard& operator=(const core_guard&) = delete;
+  };
+
+  inline std::atomic<uint64_t> next_id{1};
+  // Context that loaded its key schedule last, and the key serial of the core
+  // right after; guarded by the core lock.
+  inline uint64_t core_owner = 0;
+  inline uint32_t core_serial = 0;
+
+  inline void zeroize(void* p, std::size_t len) noexcept
+  {
+    volatile uint8_t* v = static_cast<volatile uint8_t*>(p);
+    while (len--)
+    {
+      *v++ = 0;
+    }
+  }
+}
+
+template <unsigned KeyBits, class Profile = build_profile>
+class masked_aes
+{
+  static_assert(KeyBits == 128, "the masked core implements AES-128 only");
+  static_assert(std::is_same_v<Profile, build_profile>,
+                "aes.c is built for a different profile; rebuild it with the matching MASKING_ORDER/FAULT_DETECTION/LOW_RAM");
+
+public:
+  static constexpr std::size_t key_size = KeyBits / 8;
+  static constexpr std::size_t block_size = AES_BLOCKLEN;
+  using profile_type = Profile;
+
+  explicit masked_aes(std::span<const uint8_t, key_size> key) noexcept
+    : id_(detail::next_id.fetch_add(1, std::memory_order_relaxed))
+  {
+    for (std::size_t i = 0; i < key_size; ++i)
+    {
+      key_[i] = key[i];
+    }
+  }
+
+  masked_aes(const masked_aes&) = delete;
+  masked_aes& operator=(const masked_aes&) = delete;
+
+  // The core may still hold the schedule of the moved-from key; the id moves
+  // with the key, so it stays valid for the new owner.
+  masked_aes(masked_aes&& other) noexcept
+    : id_(other.id_)
+  {
+    take(other);
+  }
+
+  masked_aes& operator=(masked_aes&& other) noexcept
+  {
+    if (this != &other)
+    {
+      release();
+      detail::zeroize(key_, key_size);
+      id_ = other.id_;
+      take(other);
+    }
+    return *this;
+  }
+
+  ~masked_aes()
+  {
+    release();
+    detail::zeroize(key_, key_size);
+  }
+
+  // One block, in place.
+  void encrypt(std::span<uint8_t, block_size> block)
+  {
+    detail::core_guard guard;
+    load_key();
+    check(AES128_ECB_indp_crypto(block.data()));
+  }
+
+  // One block, from in to out.
+  void encrypt(std::span<const uint8_t, block_size> in, std::span<uint8_t, block_size> out)
+  {
+    for (std::size_t i = 0; i < block_size; ++i)
+    {
+      out[i] = in[i];
+    }
+    encrypt(out);
+  }
+
+  // Contiguous blocks, in place, under a single lock and key load.
+  // blocks.size() must be a multiple of block_size. A separate name from
+  // encrypt(), which a 16-byte array would otherwise match both ways.
+  void encrypt_blocks(std::span<uint8_t> blocks)
+  {
+    if (blocks.size() % block_size != 0)
+    {
+      throw std::invalid_argument("aes_masked: length is not a multiple of the block size");
+    }
+    detail::core_guard guard;
+    load_key();
+    for (std::size_t off = 0; off < blocks.size(); off += block_size)
+    {
+      check(AES128_ECB_indp_crypto(blocks.data() + off));
+    }
+  }
+
+#if FAULT_DETECTION
+  // Faults detected by the core since power-up, across all contexts.
+  static uint32_t faults()
+  {
+    detail::core_guard guard;
+    return AES128_ECB_indp_faults();
+  }
+#endif
+
+private:
+  void take(masked_aes& other) noexcept
+  {
+    for (std::size_t i = 0; i < key_size; ++i)
+    {
+      key_[i] = other.key_[i];
+    }
+    detail::zeroize(other.key_, key_size);
+    other.id_ = 0;
+  }
+
+  // Wipes the core schedule if it still is the one this context loaded. The
+  // expanded schedule starts with the key itself.
+  void release() noexcept
+  {
+    if (id_ == 0)
+    {
+      return;
+    }
+    detail::core_guard guard;
+    if (detail::core_owner == id_)
+    {
+      if (detail::core_serial == AES128_ECB_indp_key_serial())
+      {
+        AES128_ECB_indp_wipe();
+      }
+      detail::core_owner = 0;
+    }
+  }
+
+  // Called with the core lock held.
+  void load_key()
+  {
+    if (id_ == 0)
+    {
+      throw std::logic_error("aes_masked: use of a moved-from context");
+    }
+    if (detail::core_owner != id_ || detail::core_serial != AES128_ECB_indp_key_serial())
+    {
+      AES128_ECB_indp_setkey(key_);
+      detail::core_owner = id_;
+      detail::core_serial = AES128_ECB_indp_key_serial();
+    }
+  }
+
+  static void check(uint8_t status)
+  {
+    if (status != AES_SUCCESS)
+    {
+      throw core_error(status);
+    }
+  }
+
+  uint64_t id_;
+  uint8_t key_[key_size];
+};
+
+using masked_aes128 = masked_aes<128>;
+
+} // namespace aes_masked
+
+#endif // _AES_MASKED_HPP_
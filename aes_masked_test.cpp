@@ -0,0 +1,137 @@
+/*
+ * Compile-and-run test of aes_masked.hpp.
+ *
+ *   cc -O2 -c aes.c && c++ -std=c++20 -O2 aes_masked_test.cpp aes.o -o aes_masked_test && ./aes_masked_test
+ *
+ * Encrypts the FIPS-197 / SP 800-38A ECB-AES128 vector through every
+ * overload, with std::array, C arrays and spans, and checks the context
+ * rules: key reloads after other users of the core, moved-from contexts and
+ * lengths that are not whole blocks.
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "aes_masked.hpp"
+
+namespace {
+
+const uint8_t key[16]    = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+const uint8_t plain[16]  = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a };
+const uint8_t cipher[16] = { 0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97 };
+
+int failures = 0;
+
+void expect(bool ok, const char* what)
+{
+  if (!ok)
+  {
+    std::printf("FAILURE: %s\n", what);
+    failures++;
+  }
+}
+
+bool is_cipher(const uint8_t* p)
+{
+  return std::memcmp(p, cipher, 16) == 0;
+}
+
+} // namespace
+
+int main()
+{
+  aes_masked::masked_aes128 aes(key);
+
+  // One block in place: C array, std::array, span
+  uint8_t c_block[16];
+  std::memcpy(c_block, plain, 16);
+  aes.encrypt(c_block);
+  expect(is_cipher(c_block), "encrypt(uint8_t[16])");
+
+  std::array<uint8_t, 16> a_block;
+  std::memcpy(a_block.data(), plain, 16);
+  aes.encrypt(a_block);
+  expect(is_cipher(a_block.data()), "encrypt(std::array<uint8_t, 16>)");
+
+  std::memcpy(c_block, plain, 16);
+  aes.encrypt(std::span<uint8_t, 16>(c_block));
+  expect(is_cipher(c_block), "encrypt(std::span<uint8_t, 16>)");
+
+  // One block, in to out
+  const std::array<uint8_t, 16> a_in = [] { std::array<uint8_t, 16> a; std::memcpy(a.data(), plain, 16); return a; }();
+  uint8_t c_out[16] = { 0 };
+  aes.encrypt(a_in, c_out);
+  expect(is_cipher(c_out), "encrypt(const std::array&, uint8_t[16])");
+
+  // Whole blocks
+  std::array<uint8_t, 48> a_blocks;
+  for (std::size_t off = 0; off < a_blocks.size(); off += 16)
+  {
+    std::memcpy(a_blocks.data() + off, plain, 16);
+  }
+  aes.encrypt_blocks(a_blocks);
+  expect(is_cipher(a_blocks.data()) && is_cipher(a_blocks.data() + 16) && is_cipher(a_blocks.data() + 32),
+         "encrypt_blocks(std::array<uint8_t, 48>)");
+
+  uint8_t c_blocks[32];
+  std::memcpy(c_blocks, plain, 16);
+  std::memcpy(c_blocks + 16, plain, 16);
+  aes.encrypt_blocks(c_blocks);
+  expect(is_cipher(c_blocks) && is_cipher(c_blocks + 16), "encrypt_blocks(uint8_t[32])");
+
+  bool threw = false;
+  try
+  {
+    aes.encrypt_blocks(std::span<uint8_t>(c_blocks, 17));
+  }
+  catch (const std::invalid_argument&)
+  {
+    threw = true;
+  }
+  expect(threw, "encrypt_blocks() of a partial block throws");
+
+  // Another key loaded into the core in between, directly or by another context
+  uint8_t other_key[16] = { 1 };
+  AES128_core_lock();
+  AES128_ECB_indp_setkey(other_key);
+  AES128_core_unlock();
+  std::memcpy(c_block, plain, 16);
+  aes.encrypt(c_block);
+  expect(is_cipher(c_block), "key reloaded after a direct setkey");
+
+  {
+    aes_masked::masked_aes128 other(other_key);
+    other.encrypt(a_block);
+  }
+  std::memcpy(c_block, plain, 16);
+  aes.encrypt(c_block);
+  expect(is_cipher(c_block), "key reloaded after another context");
+
+  // Moving hands the key over and leaves the source unusable
+  aes_masked::masked_aes128 moved(std::move(aes));
+  std::memcpy(c_block, plain, 16);
+  moved.encrypt(c_block);
+  expect(is_cipher(c_block), "encrypt() after a move");
+
+  threw = false;
+  try
+  {
+    aes.encrypt(c_block);
+  }
+  catch (const std::logic_error&)
+  {
+    threw = true;
+  }
+  expect(threw, "a moved-from context throws");
+
+  if (failures == 0)
+  {
+    std::printf("aes_masked: all checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
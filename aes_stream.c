@@ -0,0 +1,607 @@
+/*
+ * File/stream encryption tool on top of the masked AES-128 core.
+ *
+ * Build:
+ *   cc -O2 -pthread aes_stream.c aes.c -o aes_stream
+ *
+ * Usage:
+ *   aes_stream -m ctr|cbc -K <key file> -i <32 hex> [-c chunk_kb] [-n slots] [in [out]]
+ *
+ * The key file holds the key as 32 hex digits. To hand the key over on a file
+ * descriptor instead of a file, name the descriptor: -K /dev/fd/3 3<<<"$KEY".
+ * -k takes the key on the command line, where other users can read it in ps
+ * and /proc/<pid>/cmdline, and is only meant for tests.
+ *
+ * Regular input files are memory-mapped, anything else (pipes, terminals) is
+ * read through page-aligned chunk buffers. Three threads pipeline the work:
+ *
+ *   reader -> cipher -> writer
+ *
+ * They hand chunks to each other through a fixed ring of slots, so memory use
+ * is (slots * chunk size) whatever the input length, and chunks leave the
+ * writer in the order they were read.
+ *
+ * The cipher core keeps its key schedule and state in globals (see aes.h), so
+ * exactly one thread runs it; the other two overlap the I/O with it.
+ *
+ * CTR is its own inverse. CBC is encrypt-only with PKCS#7 padding, since the
+ * core implements the forward cipher only.
+ *
+ * Throughput statistics are printed on stderr when the input is exhausted.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+#define DEFAULT_CHUNK_KB 256
+#define DEFAULT_SLOTS    4
+
+enum { MODE_CTR, MODE_CBC };
+
+enum { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+struct slot
+{
+  int            state;
+  int            last;   // final chunk of the input
+  const uint8_t* in;     // input bytes: into the mapping, or == buf
+  uint8_t*       buf;    // page-aligned, chunk + one padding block
+  size_t         len;
+};
+
+struct stage_stats
+{
+  double   busy;         // seconds spent doing work
+  double   stalled;      // seconds spent waiting on a neighbour stage
+  uint64_t chunks;
+};
+
+static struct
+{
+  int             mode;
+  int             fd_in;
+  int             fd_out;
+  const uint8_t*  map;   // NULL when reading a stream
+  size_t          map_len;
+  size_t          chunk;
+  unsigned        nslots;
+  struct slot*    slots;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             error;
+
+  uint8_t         key[AES_KEYLEN];
+  uint8_t         iv[AES_BLOCKLEN];
+
+  uint64_t           bytes_in;
+  uint64_t           bytes_out;
+  struct stage_stats reader, cipher, writer;
+} g;
+
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void fail(const char* what)
+{
+  pthread_mutex_lock(&g.lock);
+  if (!g.error)
+  {
+    fprintf(stderr, "aes_stream: %s: %s\n", what, strerror(errno));
+    g.error = 1;
+  }
+  pthread_cond_broadcast(&g.cond);
+  pthread_mutex_unlock(&g.lock);
+}
+
+// Blocks until slot s reaches the wanted state. Returns 0 if the pipeline
+// was aborted meanwhile.
+static int wait_slot(struct slot* s, int wanted, struct stage_stats* st)
+{
+  double t0 = now();
+  int ok;
+  pthread_mutex_lock(&g.lock);
+  while (s->state != wanted && !g.error)
+  {
+    pthread_cond_wait(&g.cond, &g.lock);
+  }
+  ok = !g.error;
+  pthread_mutex_unlock(&g.lock);
+  st->stalled += now() - t0;
+  return ok;
+}
+
+static void post_slot(struct slot* s, int state)
+{
+  pthread_mutex_lock(&g.lock);
+  s->state = state;
+  pthread_cond_broadcast(&g.cond);
+  pthread_mutex_unlock(&g.lock);
+}
+
+
+/*****************************************************************************/
+/* Reader stage                                                              */
+/*****************************************************************************/
+// Reads up to len bytes, fewer only at end of input. Returns -1 on a read
+// error, which has then been reported through fail().
+static int read_full(int fd, uint8_t* buf, size_t len, size_t* got)
+{
+  *got = 0;
+  while (*got < len)
+  {
+    ssize_t r = read(fd, buf + *got, len - *got);
+    if (r == 0)
+    {
+      break;
+    }
+    if (r < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      fail("read");
+      return -1;
+    }
+    *got += (size_t)r;
+  }
+  return 0;
+}
+
+static void* reader_main(void* arg)
+{
+  uint64_t seq;
+  size_t offset = 0;
+  (void)arg;
+
+  for (seq = 0;; ++seq)
+  {
+    struct slot* s = &g.slots[seq % g.nslots];
+    int last;
+    double t0;
+
+    if (!wait_slot(s, SLOT_FREE, &g.reader))
+    {
+      break;
+    }
+    t0 = now();
+    if (g.map)
+    {
+      s->in = g.map + offset;
+      s->len = (g.map_len - offset < g.chunk) ? g.map_len - offset : g.chunk;
+      offset += s->len;
+      s->last = (offset == g.map_len);
+    }
+    else
+    {
+      s->in = s->buf;
+      if (read_full(g.fd_in, s->buf, g.chunk, &s->len) < 0)
+      {
+        break;
+      }
+      s->last = (s->len < g.chunk);
+    }
+    g.bytes_in += s->len;
+    last = s->last;
+    g.reader.busy += now() - t0;
+    g.reader.chunks++;
+    post_slot(s, SLOT_READ);
+    if (last)
+    {
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+/*****************************************************************************/
+/* Cipher stage                                                              */
+/*****************************************************************************/
+// Increments the big-endian counter block.
+static void ctr_increment(uint8_t* ctr)
+{
+  int i;
+  for (i = AES_BLOCKLEN - 1; i >= 0; --i)
+  {
+    if (++ctr[i] != 0)
+    {
+      break;
+    }
+  }
+}
+
+static int ctr_chunk(struct slot* s)
+{
+  uint8_t ks[AES_BLOCKLEN];
+  size_t i, j, n;
+
+  for (i = 0; i < s->len; i += AES_BLOCKLEN)
+  {
+    memcpy(ks, g.iv, AES_BLOCKLEN);
+    if (AES128_ECB_indp_crypto(ks) != AES_SUCCESS)
+    {
+      return -1;
+    }
+    ctr_increment(g.iv);
+
+    n = (s->len - i < AES_BLOCKLEN) ? s->len - i : AES_BLOCKLEN;
+    for (j = 0; j < n; ++j)
+    {
+      s->buf[i + j] = s->in[i + j] ^ ks[j];
+    }
+  }
+  return 0;
+}
+
+// g.iv carries the previous ciphertext block from chunk to chunk.
+static int cbc_chunk(struct slot* s)
+{
+  size_t i, j, len = s->len;
+
+  if (s->last)
+  {
+    // PKCS#7: always pad, with a whole block when already aligned
+    uint8_t pad = (uint8_t)(AES_BLOCKLEN - (len % AES_BLOCKLEN));
+    if (s->in != s->buf)
+    {
+      memcpy(s->buf, s->in, len);
+      s->in = s->buf;
+    }
+    memset(s->buf + len, pad, pad);
+    len += pad;
+  }
+
+  for (i = 0; i < len; i += AES_BLOCKLEN)
+  {
+    for (j = 0; j < AES_BLOCKLEN; ++j)
+    {
+      s->buf[i + j] = s->in[i + j] ^ g.iv[j];
+    }
+    if (AES128_ECB_indp_crypto(s->buf + i) != AES_SUCCESS)
+    {
+      return -1;
+    }
+    memcpy(g.iv, s->buf + i, AES_BLOCKLEN);
+  }
+  s->len = len;
+  return 0;
+}
+
+static void* cipher_main(void* arg)
+{
+  uint64_t seq;
+  (void)arg;
+
+  AES128_ECB_indp_setkey(g.key);
+
+  for (seq = 0;; ++seq)
+  {
+    struct slot* s = &g.slots[seq % g.nslots];
+    int last;
+    double t0;
+
+    if (!wait_slot(s, SLOT_READ, &g.cipher))
+    {
+      break;
+    }
+    t0 = now();
+    if ((g.mode == MODE_CTR ? ctr_chunk(s) : cbc_chunk(s)) < 0)
+    {
+      // The core reports a detected fault or a failed allocation.
+      errno = EIO;
+      fail("cipher");
+      break;
+    }
+    last = s->last;
+    g.cipher.busy += now() - t0;
+    g.cipher.chunks++;
+    post_slot(s, SLOT_DONE);
+    if (last)
+    {
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+/*****************************************************************************/
+/* Writer stage                                                              */
+/*****************************************************************************/
+static int write_full(int fd, const uint8_t* buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t w = write(fd, buf, len);
+    if (w < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      fail("write");
+      return -1;
+    }
+    buf += w;
+    len -= (size_t)w;
+  }
+  return 0;
+}
+
+static void* writer_main(void* arg)
+{
+  uint64_t seq;
+  (void)arg;
+
+  for (seq = 0;; ++seq)
+  {
+    struct slot* s = &g.slots[seq % g.nslots];
+    int last;
+    double t0;
+
+    if (!wait_slot(s, SLOT_DONE, &g.writer))
+    {
+      break;
+    }
+    t0 = now();
+    if (write_full(g.fd_out, s->buf, s->len) < 0)
+    {
+      break;
+    }
+    g.bytes_out += s->len;
+    if (g.map)
+    {
+      // Drop the pages we are done with so the mapping does not grow the
+      // resident set with the file size.
+      uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+      uintptr_t start = (uintptr_t)(s->in) & ~(page - 1);
+      uintptr_t end = ((uintptr_t)(s->in) + s->len) & ~(page - 1);
+      if (end > start)
+      {
+        madvise((void*)start, end - start, MADV_DONTNEED);
+      }
+    }
+    last = s->last;
+    g.writer.busy += now() - t0;
+    g.writer.chunks++;
+    post_slot(s, SLOT_FREE);
+    if (last)
+    {
+      break;
+    }
+  }
+  return NULL;
+}
+
+
+/*****************************************************************************/
+/* Setup                                                                     */
+/*****************************************************************************/
+static int parse_hex(const char* hex, uint8_t* out, size_t len)
+{
+  size_t i;
+  if (strlen(hex) != 2 * len)
+  {
+    return -1;
+  }
+  for (i = 0; i < len; ++i)
+  {
+    unsigned v;
+    if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+    {
+      return -1;
+    }
+    out[i] = (uint8_t)v;
+  }
+  return 0;
+}
+
+// Reads the key as 32 hex digits from a file, trailing whitespace allowed.
+static int read_key_file(const char* path, uint8_t* key)
+{
+  char text[2 * AES_KEYLEN + 8];
+  ssize_t n;
+  int fd, rc = -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  n = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (n >= 2 * AES_KEYLEN)
+  {
+    while (n > 2 * AES_KEYLEN && (text[n - 1] == '\n' || text[n - 1] == '\r' || text[n - 1] == ' '))
+    {
+      n--;
+    }
+    text[n] = '\0';
+    rc = parse_hex(text, key, AES_KEYLEN);
+  }
+  explicit_bzero(text, sizeof(text));
+  return rc;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "usage: aes_stream -m ctr|cbc -K <key file> -i <32 hex> [-c chunk_kb] [-n slots] [in [out]]\n"
+          "  -m  mode: ctr (encrypts and decrypts) or cbc (encrypt, PKCS#7)\n"
+          "  -K  file holding the AES-128 key in hex, /dev/fd/<n> for a descriptor\n"
+          "  -k  AES-128 key in hex on the command line, visible to other users (tests only)\n"
+          "  -i  IV / initial counter block\n"
+          "  -c  chunk size in KiB (default %d)\n"
+          "  -n  pipeline slots, at least 2 (default %d)\n",
+          DEFAULT_CHUNK_KB, DEFAULT_SLOTS);
+  exit(2);
+}
+
+static void print_stage(const char* name, const struct stage_stats* st)
+{
+  fprintf(stderr, "  %-7s %8.3f s busy  %8.3f s stalled  %llu chunks\n",
+          name, st->busy, st->stalled, (unsigned long long)st->chunks);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* in_path = NULL;
+  const char* out_path = NULL;
+  int have_key = 0, have_iv = 0, opt;
+  unsigned long chunk_kb = DEFAULT_CHUNK_KB;
+  long page = sysconf(_SC_PAGESIZE);
+  void* (*const stage_main[3])(void*) = { reader_main, cipher_main, writer_main };
+  pthread_t th[3];
+  unsigned started;
+  struct stat sb;
+  double t0, elapsed;
+  unsigned i;
+
+  g.mode = -1;
+  g.nslots = DEFAULT_SLOTS;
+  while ((opt = getopt(argc, argv, "m:K:k:i:c:n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'm':
+        if (strcmp(optarg, "ctr") == 0)      g.mode = MODE_CTR;
+        else if (strcmp(optarg, "cbc") == 0) g.mode = MODE_CBC;
+        else usage();
+        break;
+      case 'K': have_key = (read_key_file(optarg, g.key) == 0); break;
+      case 'k': have_key = (parse_hex(optarg, g.key, AES_KEYLEN) == 0); break;
+      case 'i': have_iv = (parse_hex(optarg, g.iv, AES_BLOCKLEN) == 0); break;
+      case 'c': chunk_kb = strtoul(optarg, NULL, 10); break;
+      case 'n': g.nslots = (unsigned)strtoul(optarg, NULL, 10); break;
+      default:  usage();
+    }
+  }
+  if (g.mode < 0 || !have_key || !have_iv || chunk_kb == 0 || g.nslots < 2 || argc - optind > 2)
+  {
+    usage();
+  }
+  if (optind < argc && strcmp(argv[optind], "-") != 0)
+  {
+    in_path = argv[optind];
+  }
+  if (optind + 1 < argc && strcmp(argv[optind + 1], "-") != 0)
+  {
+    out_path = argv[optind + 1];
+  }
+
+  g.fd_in = in_path ? open(in_path, O_RDONLY) : STDIN_FILENO;
+  g.fd_out = out_path ? open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+  if (g.fd_in < 0 || g.fd_out < 0)
+  {
+    perror("aes_stream: open");
+    return 1;
+  }
+
+  // Whole chunks of pages, and whole AES blocks so CTR/CBC never split one.
+  g.chunk = chunk_kb * 1024;
+  g.chunk = (g.chunk + (size_t)page - 1) & ~((size_t)page - 1);
+
+  if (fstat(g.fd_in, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0)
+  {
+    void* p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, g.fd_in, 0);
+    if (p != MAP_FAILED)
+    {
+      madvise(p, (size_t)sb.st_size, MADV_SEQUENTIAL);
+      g.map = p;
+      g.map_len = (size_t)sb.st_size;
+    }
+  }
+
+  g.slots = calloc(g.nslots, sizeof(struct slot));
+  if (g.slots == NULL)
+  {
+    perror("aes_stream: calloc");
+    return 1;
+  }
+  for (i = 0; i < g.nslots; ++i)
+  {
+    void* p;
+    if (posix_memalign(&p, (size_t)page, g.chunk + AES_BLOCKLEN) != 0)
+    {
+      perror("aes_stream: posix_memalign");
+      return 1;
+    }
+    g.slots[i].buf = p;
+    g.slots[i].state = SLOT_FREE;
+  }
+  pthread_mutex_init(&g.lock, NULL);
+  pthread_cond_init(&g.cond, NULL);
+
+  t0 = now();
+  for (started = 0; started < 3; ++started)
+  {
+    int rc = pthread_create(&th[started], NULL, stage_main[started], NULL);
+    if (rc != 0)
+    {
+      // The stages already running see the error and return.
+      errno = rc;
+      fail("pthread_create");
+      break;
+    }
+  }
+  for (i = 0; i < started; ++i)
+  {
+    pthread_join(th[i], NULL);
+  }
+  elapsed = now() - t0;
+
+  fprintf(stderr, "aes_stream: %s, %s input, %zu KiB x %u slots\n",
+          g.mode == MODE_CTR ? "ctr" : "cbc", g.map ? "mapped" : "streamed",
+          g.chunk / 1024, g.nslots);
+  if (g.error)
+  {
+    // A rate over a run that stopped part way would mean nothing.
+    fprintf(stderr, "  in %llu bytes, out %llu bytes in %.3f s: aborted\n",
+            (unsigned long long)g.bytes_in, (unsigned long long)g.bytes_out, elapsed);
+  }
+  else
+  {
+    fprintf(stderr, "  in %llu bytes, out %llu bytes in %.3f s: %.2f MiB/s\n",
+            (unsigned long long)g.bytes_in, (unsigned long long)g.bytes_out, elapsed,
+            elapsed > 0 ? (double)g.bytes_in / (1024.0 * 1024.0) / elapsed : 0.0);
+  }
+  print_stage("reader", &g.reader);
+  print_stage("cipher", &g.cipher);
+  print_stage("writer", &g.writer);
+
+  // The key and chaining value must not outlive the run in freed memory.
+  explicit_bzero(g.key, sizeof(g.key));
+  explicit_bzero(g.iv, sizeof(g.iv));
+  for (i = 0; i < g.nslots; ++i)
+  {
+    free(g.slots[i].buf);
+  }
+  free(g.slots);
+  if (g.map)
+  {
+    munmap((void*)g.map, g.map_len);
+  }
+  if (out_path)
+  {
+    close(g.fd_out);
+  }
+  return g.error;
+}